@@ -0,0 +1,97 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// count connections, at most concurrency of them in flight; the server
+// closes each one as soon as it is accepted
+
+#include "bench.h"
+
+#define PORT 6603
+
+static long count, concurrency, started, accepted, finished;
+static uint64_t start;
+
+static void connect_one(void);
+
+static void open_cb(struct sev_stream *stream)
+{
+    accepted++;
+    sev_close(stream, "");
+}
+
+static void close_cb(struct sev_stream *stream, const char *reason)
+{
+    if (++finished == count) {
+        sev_loop_stop(NULL);
+        return;
+    }
+
+    if (started < count)
+        connect_one();
+}
+
+static void connect_one(void)
+{
+    struct sev_stream *stream = sev_connect(NULL, BENCH_ADDRESS, PORT);
+
+    started++;
+
+    if (!stream) {
+        fprintf(stderr, "sev_connect failed\n");
+        exit(1);
+    }
+
+    stream->close_cb = close_cb;
+}
+
+int main(int argc, char *argv[])
+{
+    struct sev_server server;
+
+    count = bench_arg(argc, argv, 1, 20000);
+    concurrency = bench_arg(argc, argv, 2, 64);
+
+    if (sev_listen(NULL, &server, BENCH_ADDRESS, PORT)) {
+        perror("sev_listen");
+        return 1;
+    }
+
+    server.open_cb = open_cb;
+
+    start = sev_clock();
+
+    while (started < concurrency && started < count)
+        connect_one();
+
+    sev_loop();
+
+    double seconds = bench_seconds(start);
+
+    printf("{\"bench\":\"accept_rate\",\"count\":%ld,\"concurrency\":%ld,"
+        "\"accepted\":%ld,\"seconds\":%.3f,\"per_s\":%.0f}\n",
+        count, concurrency, accepted, seconds, accepted / seconds);
+
+    return 0;
+}
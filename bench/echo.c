@@ -0,0 +1,111 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// ping-pong of size byte messages over one connection, one in flight
+
+#include <string.h>
+#include "bench.h"
+
+#define PORT 6601
+#define WARMUP 1000
+
+static long count, size, rounds;
+static size_t received;
+static uint64_t sent_at;
+static char *message;
+static struct sev_histogram histogram;
+
+static void echo_cb(struct sev_stream *stream, char *data, size_t len)
+{
+    sev_send(stream, data, len);
+}
+
+static void ping(struct sev_stream *stream)
+{
+    received = 0;
+    sent_at = sev_clock();
+    sev_send(stream, message, size);
+}
+
+static void pong_cb(struct sev_stream *stream, char *data, size_t len)
+{
+    received += len;
+    if (received < size)
+        return;
+
+    if (++rounds > WARMUP)
+        sev_histogram_add(&histogram, sev_clock() - sent_at);
+
+    if (rounds == count + WARMUP) {
+        sev_close(stream, "done");
+        sev_loop_stop(NULL);
+        return;
+    }
+
+    ping(stream);
+}
+
+static void connect_cb(struct sev_stream *stream, const char *error)
+{
+    if (error) {
+        fprintf(stderr, "connect: %s\n", error);
+        exit(1);
+    }
+
+    ping(stream);
+}
+
+int main(int argc, char *argv[])
+{
+    struct sev_server server;
+
+    count = bench_arg(argc, argv, 1, 100000);
+    size = bench_arg(argc, argv, 2, 64);
+    message = calloc(1, size);
+
+    if (sev_listen(NULL, &server, BENCH_ADDRESS, PORT)) {
+        perror("sev_listen");
+        return 1;
+    }
+
+    server.read_cb = echo_cb;
+
+    struct sev_stream *stream = sev_connect(NULL, BENCH_ADDRESS, PORT);
+    stream->connect_cb = connect_cb;
+    stream->read_cb = pong_cb;
+
+    sev_loop();
+
+    printf("{\"bench\":\"echo_latency\",\"count\":%ld,\"size\":%ld,"
+        "\"mean_ns\":%llu,\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,"
+        "\"max_ns\":%llu}\n", count, size,
+        (unsigned long long)(histogram.sum / histogram.count),
+        (unsigned long long)sev_histogram_percentile(&histogram, 0.5),
+        (unsigned long long)sev_histogram_percentile(&histogram, 0.99),
+        (unsigned long long)sev_histogram_percentile(&histogram, 0.999),
+        (unsigned long long)histogram.max);
+
+    return 0;
+}
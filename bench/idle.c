@@ -0,0 +1,119 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// opens count idle connections to the process itself and reports how much
+// the resident set grew per connection (one accepted and one connected
+// stream each); kernel socket memory isn't included
+
+#include <sys/resource.h>
+#include "bench.h"
+
+#define PORT 6604
+#define CONCURRENCY 256
+
+static long count, started, connected, accepted;
+
+static void connect_one(void);
+
+static void check_done(void)
+{
+    if (connected == count && accepted == count)
+        sev_loop_stop(NULL);
+}
+
+static void open_cb(struct sev_stream *stream)
+{
+    accepted++;
+    check_done();
+}
+
+static void connect_cb(struct sev_stream *stream, const char *error)
+{
+    if (error) {
+        fprintf(stderr, "connect: %s\n", error);
+        exit(1);
+    }
+
+    connected++;
+
+    if (started < count)
+        connect_one();
+
+    check_done();
+}
+
+static void connect_one(void)
+{
+    struct sev_stream *stream = sev_connect(NULL, BENCH_ADDRESS, PORT);
+
+    started++;
+
+    if (!stream) {
+        fprintf(stderr, "sev_connect failed\n");
+        exit(1);
+    }
+
+    stream->connect_cb = connect_cb;
+}
+
+int main(int argc, char *argv[])
+{
+    struct sev_server server;
+    struct rlimit rl;
+
+    count = bench_arg(argc, argv, 1, 10000);
+
+    // two descriptors per connection
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+
+        if (rl.rlim_cur != RLIM_INFINITY && count > (long)(rl.rlim_cur - 64) / 2)
+            count = (rl.rlim_cur - 64) / 2;
+    }
+
+    if (sev_listen(NULL, &server, BENCH_ADDRESS, PORT)) {
+        perror("sev_listen");
+        return 1;
+    }
+
+    server.open_cb = open_cb;
+
+    long before = bench_rss();
+
+    while (started < CONCURRENCY && started < count)
+        connect_one();
+
+    sev_loop();
+
+    long after = bench_rss();
+
+    printf("{\"bench\":\"idle_memory\",\"connections\":%ld,"
+        "\"rss_bytes\":%ld,\"bytes_per_connection\":%ld,"
+        "\"sizeof_stream\":%zu}\n", count, after - before,
+        (after - before) / count, sizeof(struct sev_stream));
+
+    return 0;
+}
@@ -0,0 +1,101 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// one connection streaming total bytes in size byte sends, paced by the
+// pause/drain callbacks
+
+#include "bench.h"
+
+#define PORT 6602
+
+static long total, size, sent, received;
+static char *chunk;
+static uint64_t start;
+
+static void pump(struct sev_stream *stream)
+{
+    while (!stream->paused && sent < total) {
+        if (sev_send(stream, chunk, size) == -1)
+            return;
+
+        sent += size;
+    }
+}
+
+static void read_cb(struct sev_stream *stream, char *data, size_t len)
+{
+    received += len;
+
+    if (received >= total)
+        sev_loop_stop(NULL);
+}
+
+static void connect_cb(struct sev_stream *stream, const char *error)
+{
+    if (error) {
+        fprintf(stderr, "connect: %s\n", error);
+        exit(1);
+    }
+
+    start = sev_clock();
+    pump(stream);
+}
+
+int main(int argc, char *argv[])
+{
+    struct sev_server server;
+
+    total = bench_arg(argc, argv, 1, 1024L * 1024 * 1024);
+    size = bench_arg(argc, argv, 2, 16 * 1024);
+    chunk = calloc(1, size);
+    total -= total % size;
+
+    if (sev_listen(NULL, &server, BENCH_ADDRESS, PORT)) {
+        perror("sev_listen");
+        return 1;
+    }
+
+    server.read_cb = read_cb;
+
+    struct sev_stream *stream = sev_connect(NULL, BENCH_ADDRESS, PORT);
+    stream->connect_cb = connect_cb;
+    stream->drain_cb = pump;
+
+    sev_loop();
+
+    double seconds = bench_seconds(start);
+    struct sev_stats stats;
+    sev_loop_stats(NULL, &stats);
+
+    printf("{\"bench\":\"throughput\",\"bytes\":%ld,\"size\":%ld,"
+        "\"seconds\":%.3f,\"mb_per_s\":%.1f,\"writes\":%llu,"
+        "\"partial_writes\":%llu,\"reads\":%llu}\n",
+        received, size, seconds, received / seconds / 1e6,
+        (unsigned long long)stats.counters.writes,
+        (unsigned long long)stats.counters.partial_writes,
+        (unsigned long long)stats.counters.reads);
+
+    return 0;
+}
@@ -0,0 +1,98 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// one socket blasts batches of size byte datagrams at another on the same
+// loop for the given number of seconds
+
+#include "bench.h"
+#include "../sev_udp.h"
+
+#define PORT 6605
+
+static long size, received;
+static struct sev_udp *sender;
+static struct sev_udp_msg msgs[UDP_BATCH_SIZE];
+
+static void read_cb(struct sev_udp *udp, char *data, size_t len,
+    struct sev_addr *addr)
+{
+    received++;
+}
+
+// sends whenever the loop has nothing else to do
+static void idle_cb(EV_P_ struct ev_idle *watcher, int revents)
+{
+    sev_udp_sendto_batch(sender, msgs, UDP_BATCH_SIZE);
+}
+
+static void timer_cb(EV_P_ struct ev_timer *watcher, int revents)
+{
+    ev_break(EV_A_ EVBREAK_ALL);
+}
+
+int main(int argc, char *argv[])
+{
+    double seconds = bench_arg(argc, argv, 1, 2);
+    int i;
+
+    size = bench_arg(argc, argv, 2, 64);
+
+    struct sev_udp *receiver = sev_udp_bind(NULL, BENCH_ADDRESS, PORT);
+    sender = sev_udp_bind(NULL, BENCH_ADDRESS, PORT + 1);
+
+    if (!receiver || !sender) {
+        perror("sev_udp_bind");
+        return 1;
+    }
+
+    receiver->read_cb = read_cb;
+
+    char *payload = calloc(1, size);
+    for (i = 0; i < UDP_BATCH_SIZE; i++) {
+        msgs[i].data = payload;
+        msgs[i].len = size;
+        sev_addr_set(&msgs[i].addr, BENCH_ADDRESS, PORT);
+    }
+
+    struct ev_loop *ev = sev_loop_default()->ev;
+    struct ev_idle idle;
+    struct ev_timer timer;
+
+    ev_idle_init(&idle, idle_cb);
+    ev_idle_start(ev, &idle);
+    ev_timer_init(&timer, timer_cb, seconds, 0);
+    ev_timer_start(ev, &timer);
+
+    uint64_t start = sev_clock();
+    sev_loop();
+    seconds = bench_seconds(start);
+
+    printf("{\"bench\":\"udp_pps\",\"size\":%ld,\"seconds\":%.3f,"
+        "\"sent\":%llu,\"received\":%ld,\"pps\":%.0f}\n", size, seconds,
+        (unsigned long long)sender->stats.datagrams_out, received,
+        received / seconds);
+
+    return 0;
+}
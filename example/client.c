@@ -37,6 +37,14 @@ static void read_cb(struct sev_stream *stream, char *data, size_t len)
     printf("read %s: %s\n", stream->remote_address, data);
 }
 
+static void connect_cb(struct sev_stream *stream, const char *error)
+{
+    if (error)
+        printf("connect failed: %s\n", error);
+    else
+        printf("connected to %s\n", stream->remote_address);
+}
+
 static void close_cb(struct sev_stream *stream, const char *reason)
 {
     printf("close %s %s\n", stream->remote_address, reason);
@@ -52,18 +60,20 @@ int main(int argc, char *argv[])
 {
     printf("connecting to %s:%d...\n", ADDRESS, PORT);
 
-    struct sev_stream *stream = sev_connect(ADDRESS, PORT);
+    struct sev_stream *stream = sev_connect(NULL, ADDRESS, PORT);
 
     if (!stream) {
         perror("sev_connect");
         return -1;
     }
 
+    stream->connect_cb = connect_cb;
     stream->read_cb = read_cb;
     stream->close_cb = close_cb;
     stream->data = NULL;
 
-    printf("connected. sending request...\n");
+    // queued until the connection is up
+    printf("sending request...\n");
     sev_send(stream, request, strlen(request));
 
     sev_loop();
@@ -36,12 +36,9 @@ void open_cb(struct sev_stream *stream)
         stream->remote_port);
 }
 
+// called once per line, without the newline
 void read_cb(struct sev_stream *stream, char *data, size_t len)
 {
-    data[len] = '\0';
-    if (data[len-1] == '\n')
-        data[len-1] = '\0';
-
     printf("read %s: %s\n", stream->remote_address, data);
 
     if (sev_send(stream, "hello\n", 6) == -1)
@@ -60,7 +57,7 @@ int main(int argc, char *argv[])
 {
     struct sev_server server;
 
-    if (sev_listen(&server, ADDRESS, PORT)) {
+    if (sev_listen(NULL, &server, ADDRESS, PORT)) {
         perror("sev_listen");
         return -1;
     }
@@ -68,6 +65,7 @@ int main(int argc, char *argv[])
     server.open_cb = open_cb;
     server.read_cb = read_cb;
     server.close_cb = close_cb;
+    sev_frame_delimiter(&server.frame, "\n", 0);
 
     printf("listening on %s:%d\n", ADDRESS, PORT);
 
@@ -23,301 +23,4058 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE
 #include <signal.h>
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <limits.h>
+#include <stddef.h>
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
 #include <netdb.h>
+#include <sched.h>
+#include <pthread.h>
 #include <ev.h>
 #include "sev.h"
 
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
+static void stream_schedule(struct sev_stream *stream);
+static void stream_close(struct sev_stream *stream, enum sev_close_code code,
+    const char *reason);
+
+// counts on the stream, its server and its loop
+#define COUNT(stream, field, n) do { \
+        (stream)->stats.field += (n); \
+        if ((stream)->server) \
+            (stream)->server->stats.field += (n); \
+        (stream)->loop->stats.field += (n); \
+    } while (0)
+
+// sev_loop_histograms()
+struct sev_latency {
+    struct sev_histogram iteration;
+    struct sev_histogram callback;
+
+    struct ev_check w_check;
+    struct ev_prepare w_prepare;
+    uint64_t woke;
+};
+
+// returns 0 unless callback times are being recorded
+static inline uint64_t callback_start(struct sev_loop *loop)
+{
+    return loop->latency ? sev_clock() : 0;
+}
 
-// callbacks
+static inline void callback_end(struct sev_loop *loop, uint64_t start)
+{
+    if (start && loop->latency)
+        sev_histogram_add(&loop->latency->callback, sev_clock() - start);
+}
 
-static void stream_write(struct sev_stream *stream)
+#ifdef SEV_URING
+static void uring_recv(struct sev_stream *stream);
+static void uring_send(struct sev_stream *stream);
+static void uring_cancel(struct sev_stream *stream, int op);
+static void uring_resume(struct sev_stream *stream);
+static void uring_accept(struct sev_server *server);
+static int uring_attach(struct sev_stream *stream);
+static void uring_detach(struct sev_stream *stream);
+#endif
+
+#ifdef SEV_TLS
+static void tls_handshake(struct sev_stream *stream);
+static ssize_t tls_recv(struct sev_stream *stream, char *buffer, size_t size);
+static void tls_write(struct sev_stream *stream);
+#endif
+
+// the handshake is still running, data is only queued
+static inline int tls_handshaking(struct sev_stream *stream)
 {
-    int len = MIN(stream->buffer_len, SEND_BUFFER_SIZE - stream->buffer_start);
+#ifdef SEV_TLS
+    return stream->tls && stream->tls->handshaking;
+#else
+    return 0;
+#endif
+}
 
-    int n = send(stream->sd, stream->buffer + stream->buffer_start, len, 0);
+// records are sealed in user space, sends go through SSL_write()
+static inline int tls_user_send(struct sev_stream *stream)
+{
+#ifdef SEV_TLS
+    return stream->tls && !stream->tls->ktls_send;
+#else
+    return 0;
+#endif
+}
 
-    if (n == -1) {
-        sev_close(stream, strerror(errno));
-        return;
-    }
+// reads go through SSL_read() even with kernel TLS, plain recv() fails on
+// records other than application data like session tickets and alerts
+static inline int tls_recv_ssl(struct sev_stream *stream)
+{
+#ifdef SEV_TLS
+    return stream->tls != NULL;
+#else
+    return 0;
+#endif
+}
+
+static inline int tls_pending(struct sev_stream *stream)
+{
+#ifdef SEV_TLS
+    return tls_recv_ssl(stream) && sev_tls_pending(stream->tls);
+#else
+    return 0;
+#endif
+}
 
-    stream->buffer_start = (stream->buffer_start + n) % SEND_BUFFER_SIZE;
-    stream->buffer_len -= n;
+static void stream_error(struct sev_stream *stream, int error)
+{
+    enum sev_close_code code = SEV_CLOSE_ERROR;
 
-    if (stream->buffer_len == 0) {
-        // reset circular buffer to the beginning
-        stream->buffer_start = 0;
-        stream->buffer_end = 0;
+    if (error == ECONNRESET || error == EPIPE)
+        code = SEV_CLOSE_PEER;
 
-        stream->writing = 0;
-        ev_io_stop(EV_DEFAULT_ &stream->w_write);
-    }
+    stream_close(stream, code, strerror(error));
 }
 
-static void stream_read(struct sev_stream *stream)
+// called on activity, the deadline itself is only checked once it is due
+static inline void stream_touch(struct sev_stream *stream)
 {
-    static char buffer[RECV_BUFFER_SIZE];
-    ssize_t n = recv(stream->sd, buffer, RECV_BUFFER_SIZE - 1, 0);
+    if (!sev_timer_pending(&stream->timer))
+        stream_schedule(stream);
+}
 
-    if (n == -1) {
-        // error
-        sev_close(stream, strerror(errno));
-        return;
-    }
+// handles
 
-    if (n == 0) {
-        // client disconnected
-        sev_close(stream, strerror(ECONNRESET));
-        return;
+#define SLOTS_MIN 64
+
+struct sev_slot {
+    struct sev_stream *stream;
+
+    // bumped whenever the slot is reused, stale handles don't match
+    uint32_t generation;
+    uint32_t next_free;
+};
+
+static void slot_put(struct sev_loop *loop, uint32_t slot)
+{
+    struct sev_slot *entry = &loop->slots[slot - 1];
+
+    entry->stream = NULL;
+    entry->generation++;
+    entry->next_free = loop->slot_free;
+    loop->slot_free = slot;
+}
+
+static uint32_t slot_get(struct sev_loop *loop, struct sev_stream *stream)
+{
+    if (!loop->slot_free) {
+        uint32_t count = loop->slot_count ? loop->slot_count * 2 : SLOTS_MIN;
+        struct sev_slot *slots = realloc(loop->slots,
+            count * sizeof(struct sev_slot));
+        if (!slots)
+            return 0;
+
+        // chain the new slots, generations start at 1 so ids are never 0
+        uint32_t i;
+        for (i = loop->slot_count; i < count; i++) {
+            slots[i].stream = NULL;
+            slots[i].generation = 1;
+            slots[i].next_free = i + 1 < count ? i + 2 : 0;
+        }
+
+        loop->slot_free = loop->slot_count + 1;
+        loop->slots = slots;
+        loop->slot_count = count;
     }
 
-    if (stream->read_cb)
-        stream->read_cb(stream, buffer, n);
+    uint32_t slot = loop->slot_free;
+    struct sev_slot *entry = &loop->slots[slot - 1];
+
+    loop->slot_free = entry->next_free;
+    entry->stream = stream;
+
+    return slot;
 }
 
-static void stream_cb(EV_P_ struct ev_io *watcher, int revents)
+// kernel timestamps
+
+#define TX_STAMP_FLAGS (SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_TX_ACK)
+
+static inline ev_tstamp timespec_time(const struct timespec *ts)
 {
-    if (revents & EV_ERROR) {
-        sev_close(watcher->data, strerror(errno));
-        return;
+    return ts->tv_sec + ts->tv_nsec * 1e-9;
+}
+
+// the software receive time in a message's control data, 0 if none
+static ev_tstamp control_time(struct msghdr *msg)
+{
+    struct cmsghdr *cmsg;
+
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET &&
+                cmsg->cmsg_type == SCM_TIMESTAMPING) {
+            struct scm_timestamping stamps;
+            memcpy(&stamps, CMSG_DATA(cmsg), sizeof(stamps));
+            return timespec_time(&stamps.ts[0]);
+        }
     }
 
-    if (revents & EV_READ) {
-        stream_read(watcher->data);
+    return 0;
+}
+
+// picks every tx_sample-th send to be timed, while none is in flight
+static inline void stream_sample(struct sev_stream *stream)
+{
+    if (!stream->tx_sample || stream->tx_wanted || stream->tx_inflight ||
+            ++stream->tx_count < stream->tx_sample)
         return;
-    }
 
-    if (revents & EV_WRITE) {
-        stream_write(watcher->data);
+    stream->tx_count = 0;
+    stream->tx_wanted = 1;
+    stream->tx_queued = ev_time();
+}
+
+// asks for timestamps on the write about to go out with msg, if one is
+// wanted; control must hold CMSG_SPACE(sizeof(uint32_t))
+static inline void stream_stamp(struct sev_stream *stream,
+    struct msghdr *msg, char *control)
+{
+    if (!stream->tx_wanted)
         return;
-    }
+
+    uint32_t flags = TX_STAMP_FLAGS;
+
+    msg->msg_control = control;
+    msg->msg_controllen = CMSG_SPACE(sizeof(flags));
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SO_TIMESTAMPING;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(flags));
+    memcpy(CMSG_DATA(cmsg), &flags, sizeof(flags));
 }
 
-static struct sev_stream *sev_stream_new(int sd, struct sockaddr_in *addr)
+// after a write went out, stamped or not
+static inline void stream_stamped(struct sev_stream *stream,
+    struct msghdr *msg)
 {
-    // set non-blocking
-    int flags = fcntl(sd, F_GETFL, 0);
-    flags |= O_NONBLOCK;
-    fcntl(sd, F_SETFL, flags);
+    if (msg->msg_control) {
+        stream->tx_wanted = 0;
+        stream->tx_inflight = 1;
+    }
+}
 
-    // disable nagle's algorithm
-    int flag = 1;
-    setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(int));
+// a timestamp of the sampled send came back
+static void tx_timestamp(struct sev_stream *stream, uint32_t what,
+    ev_tstamp when)
+{
+    struct sev_timing *timing = stream->server ? stream->server->timing : NULL;
+    uint64_t span = when > stream->tx_queued ?
+        (uint64_t)((when - stream->tx_queued) * 1e9) : 0;
 
-    // initialize sev_stream structure
-    struct sev_stream *stream = calloc(1, sizeof(struct sev_stream));
+    if (what == SCM_TSTAMP_SND && timing)
+        sev_histogram_add(&timing->sent, span);
 
-    stream->sd = sd;
-    stream->remote_port = addr->sin_port;
-    inet_ntop(AF_INET, &addr->sin_addr, stream->remote_address,
-        INET_ADDRSTRLEN);
+    if (what == SCM_TSTAMP_ACK) {
+        if (timing)
+            sev_histogram_add(&timing->acked, span);
 
-    // register with libev
-    ev_io_init(&stream->w_read, stream_cb, sd, EV_READ);
-    ev_io_start(EV_DEFAULT_ &stream->w_read);
-    stream->reading = 1;
+        stream->tx_inflight = 0;
+    }
+}
 
-    ev_io_init(&stream->w_write, stream_cb, sd, EV_WRITE);
-    stream->writing = 0;
+// the part of a read's latency before read_cb, returns the clock to time
+// read_cb with or 0 if the stream isn't timed
+static inline uint64_t timing_start(struct sev_stream *stream)
+{
+    if (!stream->arrival || !stream->server || !stream->server->timing)
+        return 0;
 
-    stream->w_read.data = stream;
-    stream->w_write.data = stream;
+    sev_timing_arrival(stream->server->timing, stream->arrival,
+        ev_now(stream->loop->ev), ev_time());
 
-    return stream;
+    return sev_clock();
 }
 
-static void accept_cb(EV_P_ struct ev_io *watcher, int revents)
+static inline void timing_end(struct sev_stream *stream, uint64_t start)
 {
-    // accept client socket
-    struct sockaddr_in addr;
-    socklen_t addr_len = sizeof(addr);
+    if (start) {
+        sev_histogram_add(&stream->server->timing->callback,
+            sev_clock() - start);
+    }
+}
 
-    int sd = accept(watcher->fd, (struct sockaddr *)&addr, &addr_len);
-    if (sd == -1)
-        return;
+// zero copy sends
 
-    struct sev_stream *stream = sev_stream_new(sd, &addr);
+struct sev_zerocopy {
+    struct sev_zerocopy *next;
 
-    struct sev_server *server = watcher->data;
-    stream->server = server;
+    // sends are numbered per socket by the kernel, from 0
+    uint32_t id;
+    struct sev_buf *buf;
+};
 
-    // initialize callbacks
-    stream->read_cb = server->read_cb;
-    stream->close_cb = server->close_cb;
+// a closed stream's socket, kept open until the kernel is done with its
+// zero copy sends
+struct sev_linger {
+    struct sev_linger *next;
+    int sd;
+    ev_tstamp deadline;
+    struct sev_zerocopy *pending;
+};
 
-    // call open callback
-    if (server->open_cb)
-        server->open_cb(stream);
+// releases the buffers of the sends up to last, returns the rest
+static struct sev_zerocopy *zerocopy_release(struct sev_zerocopy *pending,
+    uint32_t last)
+{
+    while (pending && (int32_t)(pending->id - last) <= 0) {
+        struct sev_zerocopy *next = pending->next;
+
+        sev_buf_release(pending->buf);
+        free(pending);
+        pending = next;
+    }
+
+    return pending;
 }
 
-// interface
+static void zerocopy_done(struct sev_stream *stream, uint32_t last)
+{
+    stream->zerocopy_pending = zerocopy_release(stream->zerocopy_pending,
+        last);
 
-int sev_send(struct sev_stream *stream, const char *data, size_t len)
+    if (!stream->zerocopy_pending)
+        stream->zerocopy_last = NULL;
+}
+
+// the error a control message carries, NULL if it isn't one
+static struct sock_extended_err *cmsg_error(struct cmsghdr *cmsg)
 {
-    // try sending the data straight away
-    if (!stream->writing) {
-        int n = send(stream->sd, data, len, 0);
+    if ((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+            (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+        return (struct sock_extended_err *)CMSG_DATA(cmsg);
 
-        if (n == -1) {
-            if (errno != EAGAIN) {
-                sev_close(stream, strerror(errno));
-                return -1;
+    return NULL;
+}
+
+// reads zero copy completions and send timestamps off the socket's error
+// queue
+static void errqueue_reap(struct sev_stream *stream)
+{
+    char control[256];
+    struct msghdr msg = {};
+
+    while (stream->zerocopy_pending || stream->tx_inflight) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(stream->sd, &msg, MSG_ERRQUEUE) == -1)
+            return;
+
+        // the timestamp comes before the error describing it
+        ev_tstamp when = control_time(&msg);
+        struct cmsghdr *cmsg;
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            struct sock_extended_err *err = cmsg_error(cmsg);
+            if (!err)
+                continue;
+
+            if (err->ee_origin == SO_EE_ORIGIN_TIMESTAMPING && when) {
+                tx_timestamp(stream, err->ee_info, when);
+                continue;
             }
+
+            if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY || err->ee_errno)
+                continue;
+
+            // sends ee_info to ee_data, both included, are done
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                COUNT(stream, zerocopy_copied, err->ee_data - err->ee_info + 1);
+
+            zerocopy_done(stream, err->ee_data);
         }
-        else if (n < len) {
-            // sent part of the data
-            data += n;
-            len -= n;
-        }
-        else {
-            // sent all the data, nothing else to do here
+    }
+}
+
+// returns 1 once every send of a lingering socket is done
+static int linger_reap(struct sev_linger *linger)
+{
+    char control[256];
+    struct msghdr msg = {};
+
+    while (linger->pending) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(linger->sd, &msg, MSG_ERRQUEUE) == -1)
             return 0;
+
+        struct cmsghdr *cmsg;
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            struct sock_extended_err *err = cmsg_error(cmsg);
+
+            if (err && err->ee_origin == SO_EE_ORIGIN_ZEROCOPY &&
+                    !err->ee_errno)
+                linger->pending = zerocopy_release(linger->pending,
+                    err->ee_data);
         }
     }
 
-    // buffer full
-    if (stream->buffer_len + len > SEND_BUFFER_SIZE) {
-        sev_close(stream, "Send buffer full");
-        return -1;        
+    return 1;
+}
+
+// closes the socket once the kernel no longer reads the pending buffers;
+// the peer still gets the data and a FIN
+static void zerocopy_linger(struct sev_stream *stream)
+{
+    struct sev_loop *loop = stream->loop;
+    struct sev_linger *linger = malloc(sizeof(struct sev_linger));
+
+    shutdown(stream->sd, SHUT_WR);
+
+    // the buffers are never released rather than handed back too early
+    if (!linger) {
+        close(stream->sd);
+        stream->zerocopy_pending = NULL;
+        stream->zerocopy_last = NULL;
+        return;
     }
 
-    // write the data to the circular buffer
-    size_t first_part = MIN(SEND_BUFFER_SIZE - stream->buffer_end, len);
-    size_t second_part = len - first_part;
+    linger->sd = stream->sd;
+    linger->deadline = ev_now(loop->ev) + ZEROCOPY_LINGER;
+    linger->pending = stream->zerocopy_pending;
+    linger->next = loop->lingering;
+    loop->lingering = linger;
+
+    stream->zerocopy_pending = NULL;
+    stream->zerocopy_last = NULL;
+
+    if (!ev_is_active(&loop->w_linger))
+        ev_timer_again(loop->ev, &loop->w_linger);
+}
 
-    memcpy(stream->buffer + stream->buffer_end, data, first_part);
-    memcpy(stream->buffer, data + first_part, second_part);
+// done with the socket; buffers still pending once the linger runs out, or
+// when the loop is freed, are left alone for good
+static void linger_close(struct sev_linger *linger)
+{
+    struct sev_zerocopy *pending = linger->pending;
 
-    stream->buffer_end = (stream->buffer_end + len) % SEND_BUFFER_SIZE;
-    stream->buffer_len += len;
+    close(linger->sd);
 
-    // tell libev we want to write
-    if (!stream->writing) {
-        ev_io_start(EV_DEFAULT_ &stream->w_write);
-        stream->writing = 1;
+    while (pending) {
+        struct sev_zerocopy *next = pending->next;
+        free(pending);
+        pending = next;
     }
 
-    return 0;
+    free(linger);
 }
 
-void sev_close(struct sev_stream *stream, const char *reason)
+static void linger_cb(EV_P_ struct ev_timer *watcher, int revents)
 {
-    if (stream->close_cb)
-        stream->close_cb(stream, reason);
+    struct sev_loop *sloop = watcher->data;
+    struct sev_linger **link = &sloop->lingering;
 
-    // stop libev watchers
-    if (stream->reading)
-        ev_io_stop(EV_DEFAULT_ &stream->w_read);
+    while (*link) {
+        struct sev_linger *linger = *link;
 
-    if (stream->writing)
-        ev_io_stop(EV_DEFAULT_ &stream->w_write);
+        if (!linger_reap(linger) && ev_now(EV_A) < linger->deadline) {
+            link = &linger->next;
+            continue;
+        }
 
-    close(stream->sd);
+        *link = linger->next;
+        linger_close(linger);
+    }
 
-    free(stream);
+    if (!sloop->lingering)
+        ev_timer_stop(EV_A_ watcher);
 }
 
-int sev_listen(struct sev_server *server, const char *address, int port)
+// callbacks
+
+static void stream_free(struct sev_stream *stream)
 {
-    // create server socket
-    int sd = socket(PF_INET, SOCK_STREAM, 0);
-    if (sd == -1)
-        return -1;
+    if (stream->server) {
+        if (stream->live_prev)
+            stream->live_prev->live_next = stream->live_next;
+        else
+            stream->server->live = stream->live_next;
+        if (stream->live_next)
+            stream->live_next->live_prev = stream->live_prev;
+    }
 
-    // set reuseaddr
-    int flag = 1;
-    setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+    sev_queue_clear(&stream->queue, &stream->loop->buffers);
+    sev_frame_clear(&stream->frame, &stream->loop->buffers);
 
-    struct sockaddr_in addr = {};
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
+    if (stream->recv_buffer) {
+        sev_buffer_put(&stream->loop->buffers, stream->recv_buffer,
+            stream->recv_buffer_size);
+    }
 
-    if (inet_pton(AF_INET, address, &addr.sin_addr) != 1)
+    if (stream->recv_buf)
+        sev_buf_release(stream->recv_buf);
+
+#ifdef SEV_URING
+    if (stream->io)
+        uring_detach(stream);
+#endif
+
+    if (stream->slot)
+        slot_put(stream->loop, stream->slot);
+
+#ifdef SEV_TLS
+    if (stream->tls)
+        sev_tls_free(stream->tls);
+#endif
+
+    sev_pool_put(stream);
+}
+
+// keeps the stream around while calling back into the application
+static void stream_hold(struct sev_stream *stream)
+{
+    stream->busy++;
+}
+
+// returns -1 if the stream was closed in the meantime
+static int stream_release(struct sev_stream *stream)
+{
+    if (--stream->busy == 0 && stream->closed) {
+        stream_free(stream);
         return -1;
+    }
 
-    // bind/listen
-    if (bind(sd, (struct sockaddr*)&addr, sizeof(addr)) == -1)
+    return stream->closed ? -1 : 0;
+}
+
+// drops the file at the front of the queue once all of it was sent, returns
+// 1 or -1 if the stream was closed by sendfile_cb
+static int stream_file_sent(struct sev_stream *stream)
+{
+    int fd = stream->queue.head->fd;
+    sev_queue_pop(&stream->queue, &stream->loop->buffers);
+
+    if (stream->sendfile_cb) {
+        stream_hold(stream);
+        stream->sendfile_cb(stream, fd, 0);
+        if (stream_release(stream))
+            return -1;
+    }
+
+    return 1;
+}
+
+// returns 1 if the range was fully sent, 0 if the socket is full and -1 if
+// the stream was closed
+static int stream_sendfile(struct sev_stream *stream, struct sev_chunk *chunk)
+{
+    // an empty range is done once the data before it is out
+    if (chunk->start == chunk->end)
+        return stream_file_sent(stream);
+
+    off_t offset = chunk->start;
+
+    ssize_t n = sendfile(stream->sd, chunk->fd, &offset,
+        chunk->end - chunk->start);
+
+    COUNT(stream, writes, 1);
+
+    if (n == -1) {
+        if (errno == EAGAIN) {
+            COUNT(stream, write_eagain, 1);
+            return 0;
+        }
+
+        stream_error(stream, errno);
         return -1;
-    if (listen(sd, SOMAXCONN) == -1)
+    }
+
+    if (n == 0) {
+        // the file is shorter than promised
+        stream_close(stream, SEV_CLOSE_ERROR, "Unexpected end of file");
         return -1;
+    }
 
-    // initialize sev_server structure
-    memset(server, 0, sizeof(struct sev_server));
-    server->sd = sd;
+    COUNT(stream, bytes_out, n);
+    chunk->start += n;
+    stream->last_write = ev_now(stream->loop->ev);
 
-    // register with libev
-    ev_io_init(&server->watcher, accept_cb, sd, EV_READ);
-    server->watcher.data = server;
-    ev_io_start(EV_DEFAULT_ &server->watcher);
+    if (chunk->start < chunk->end)
+        return 0;
 
-    return 0;
+    return stream_file_sent(stream);
+}
+
+// whether len bytes of a shared buffer are worth sending without a copy
+static int zerocopy_wanted(struct sev_stream *stream, size_t len)
+{
+    if (!stream->zerocopy_threshold || len < stream->zerocopy_threshold ||
+            stream->zerocopy == -1 || stream->io || stream->tls ||
+            stream->packets)
+        return 0;
+
+    if (stream->zerocopy == 0) {
+        int flag = 1;
+        stream->zerocopy = setsockopt(stream->sd, SOL_SOCKET, SO_ZEROCOPY,
+            &flag, sizeof(flag)) ? -1 : 1;
+    }
+
+    return stream->zerocopy == 1;
 }
 
-struct sev_stream *sev_connect(const char *address, int port)
+// sends the rest of buf from offset, keeping a reference to it until the
+// kernel reports the send done; returns the bytes sent or -1 if the stream
+// was closed
+static ssize_t stream_send_zerocopy(struct sev_stream *stream,
+    struct sev_buf *buf, size_t offset)
 {
-    int sd, rv;
-    struct addrinfo *servinfo, *p;
+    size_t len = buf->len - offset;
 
-    struct addrinfo hint = {};
-    hint.ai_family = AF_INET;
-    hint.ai_socktype = SOCK_STREAM;
+    // without a record of the send, the data has to be copied
+    struct sev_zerocopy *pending = malloc(sizeof(struct sev_zerocopy));
+    int flags = pending ? MSG_ZEROCOPY : 0;
 
-    char port_str[12];
-    sprintf(port_str, "%d", port);
+    ssize_t n = send(stream->sd, buf->data + offset, len, flags);
 
-    if ((rv = getaddrinfo(address, port_str, &hint, &servinfo)) != 0)
-        return NULL;
+    // out of memory to pin pages with, copy this one
+    if (n == -1 && errno == ENOBUFS && flags) {
+        flags = 0;
+        n = send(stream->sd, buf->data + offset, len, flags);
+    }
 
-    for (p = servinfo; p != NULL; p = p->ai_next) {
-        if ((sd = socket(p->ai_family, p->ai_socktype,
-                p->ai_protocol)) == -1) {
-            continue;
-        }
+    COUNT(stream, writes, 1);
 
-        if (connect(sd, p->ai_addr, p->ai_addrlen) == -1) {
-            close(sd);
-            continue;
+    if (n > 0) {
+        COUNT(stream, bytes_out, n);
+        stream->last_write = ev_now(stream->loop->ev);
+
+        if (n < len)
+            COUNT(stream, partial_writes, 1);
+    }
+
+    if (n == -1 || !flags) {
+        free(pending);
+
+        if (n != -1)
+            return n;
+
+        if (errno != EAGAIN) {
+            stream_error(stream, errno);
+            return -1;
         }
 
-        break;
+        COUNT(stream, write_eagain, 1);
+        return 0;
     }
 
-    if (p == NULL)
-        return NULL;
+    COUNT(stream, zerocopy_sends, 1);
+
+    pending->next = NULL;
+    pending->id = stream->zerocopy_next++;
+    pending->buf = sev_buf_retain(buf);
 
-    freeaddrinfo(servinfo);
+    if (stream->zerocopy_last)
+        stream->zerocopy_last->next = pending;
+    else
+        stream->zerocopy_pending = pending;
 
-    return sev_stream_new(sd, (struct sockaddr_in *)p->ai_addr);
+    stream->zerocopy_last = pending;
+
+    return n;
 }
 
-void sev_loop(void)
+// gives unsent files back to the application
+static void stream_drop_queue(struct sev_stream *stream)
 {
-    signal(SIGPIPE, SIG_IGN);
+    while (stream->queue.head) {
+        struct sev_chunk *chunk = stream->queue.head;
+        int fd = chunk->fd;
+
+        sev_queue_pop(&stream->queue, &stream->loop->buffers);
 
-    ev_loop(EV_DEFAULT_ 0);
+        if (fd != -1 && stream->sendfile_cb)
+            stream->sendfile_cb(stream, fd, -1);
+    }
 }
 
-void sev_block_read(struct sev_stream *stream)
+// after the send queue shrank
+static void stream_wrote(struct sev_stream *stream)
 {
-    if (stream->reading) {
-        stream->reading = 0;
-        ev_io_stop(EV_DEFAULT_ &stream->w_read);
+    if (!stream->queue.head) {
+        stream->writing = 0;
+        ev_io_stop(stream->loop->ev, &stream->w_write);
+    }
+
+    // let the application produce again
+    if (stream->paused && stream->queue.len <= stream->low_watermark) {
+        stream->paused = 0;
+
+        if (stream->drain_cb)
+            stream->drain_cb(stream);
     }
 }
 
-void sev_allow_read(struct sev_stream *stream)
+static void stream_write(struct sev_stream *stream)
 {
-    if (!stream->reading) {
-        stream->reading = 1;
-        ev_io_start(EV_DEFAULT_ &stream->w_read);
+#ifdef SEV_TLS
+    if (tls_user_send(stream)) {
+        tls_write(stream);
+        return;
     }
+#endif
+
+    struct iovec iov[SEND_IOV_MAX];
+    char control[CMSG_SPACE(sizeof(uint32_t))];
+    struct msghdr msg = {};
+    msg.msg_iov = iov;
+
+    // hand as much of the queue as possible to the kernel at once
+    while (stream->queue.head) {
+        struct sev_chunk *chunk = stream->queue.head;
+
+        if (chunk->buf && zerocopy_wanted(stream, chunk->end - chunk->start)) {
+            size_t len = chunk->end - chunk->start;
+            ssize_t n = stream_send_zerocopy(stream, chunk->buf, chunk->start);
+
+            if (n == -1)
+                return;
+
+            sev_queue_consume(&stream->queue, &stream->loop->buffers, n);
+
+            if (n < len)
+                break;
+
+            continue;
+        }
+
+        if (stream->queue.head->fd != -1) {
+            if (stream_sendfile(stream, stream->queue.head) != 1)
+                return;
+            continue;
+        }
+
+        msg.msg_iovlen = sev_queue_iov(&stream->queue, iov,
+            stream->packets ? 1 : SEND_IOV_MAX);
+
+        size_t len = 0;
+        int i;
+        for (i = 0; i < msg.msg_iovlen; i++)
+            len += iov[i].iov_len;
+
+        msg.msg_control = NULL;
+        msg.msg_controllen = 0;
+        stream_stamp(stream, &msg, control);
+
+        ssize_t n = sendmsg(stream->sd, &msg, 0);
+
+        COUNT(stream, writes, 1);
+
+        if (n == -1) {
+            if (errno != EAGAIN) {
+                stream_error(stream, errno);
+                return;
+            }
+
+            COUNT(stream, write_eagain, 1);
+            break;
+        }
+
+        COUNT(stream, bytes_out, n);
+        sev_queue_consume(&stream->queue, &stream->loop->buffers, n);
+        stream->last_write = ev_now(stream->loop->ev);
+        stream_stamped(stream, &msg);
+
+        // the socket buffer is full
+        if (n < len) {
+            COUNT(stream, partial_writes, 1);
+            break;
+        }
+    }
+
+    stream_wrote(stream);
+}
+
+// a buffer of its own for each read, unless the last one wasn't kept
+static char *stream_recv_buf(struct sev_stream *stream)
+{
+    if (stream->recv_buf && stream->recv_buffer_size < stream->recv_size) {
+        sev_buf_release(stream->recv_buf);
+        stream->recv_buf = NULL;
+    }
+
+    if (!stream->recv_buf) {
+        stream->recv_buf = sev_loop_buf(stream->loop, stream->recv_size);
+        if (!stream->recv_buf)
+            return NULL;
+
+        stream->recv_buffer_size = stream->recv_size;
+    }
+
+    return stream->recv_buf->data;
+}
+
+// returns where the next read goes, *size is the room there
+static char *stream_recv_buffer(struct sev_stream *stream, size_t *size)
+{
+    // leave room for a terminating null byte
+    *size = stream->recv_size - 1;
+
+    if (stream->recv_mode == SEV_RECV_USER) {
+        *size = stream->recv_size;
+        char *buffer = stream->alloc_cb ? stream->alloc_cb(stream, size) :
+            NULL;
+
+        // the framer terminates frames in place, keep its byte inside the
+        // application's buffer
+        if (buffer && *size && stream->frame.mode != SEV_FRAME_NONE)
+            (*size)--;
+
+        return buffer;
+    }
+
+    if (stream->recv_mode == SEV_RECV_BUF)
+        return stream_recv_buf(stream);
+
+    if (stream->recv_buffer && stream->recv_buffer_size >= stream->recv_size)
+        return stream->recv_buffer;
+
+    if (stream->recv_mode == SEV_RECV_SHARED)
+        return sev_loop_buffer(stream->loop, stream->recv_size);
+
+    // recv_size grew, trade the buffer for a bigger one
+    if (stream->recv_buffer) {
+        sev_buffer_put(&stream->loop->buffers, stream->recv_buffer,
+            stream->recv_buffer_size);
+    }
+
+    stream->recv_buffer_size = sev_buffer_size(stream->recv_size);
+    stream->recv_buffer = sev_buffer_get(&stream->loop->buffers,
+        stream->recv_buffer_size);
+
+    return stream->recv_buffer;
+}
+
+static void rate_refill(struct sev_rate *rate, ev_tstamp now)
+{
+    if (!rate->rate)
+        return;
+
+    double burst = rate->burst > 0 ? rate->burst : rate->rate;
+
+    // starts out full
+    if (!rate->last)
+        rate->tokens = burst;
+    else
+        rate->tokens = MIN(burst,
+            rate->tokens + (now - rate->last) * rate->rate);
+
+    rate->last = now;
+}
+
+static inline int limit_exhausted(struct sev_limit *limit)
+{
+    return (limit->bytes.rate && limit->bytes.tokens <= 0) ||
+        (limit->messages.rate && limit->messages.tokens <= 0);
+}
+
+static inline void limit_take(struct sev_limit *limit, size_t bytes,
+    size_t messages)
+{
+    if (limit->bytes.rate)
+        limit->bytes.tokens -= bytes;
+    if (limit->messages.rate)
+        limit->messages.tokens -= messages;
+}
+
+// takes from the stream's limits and its server's; either may go into debt
+static inline void stream_take(struct sev_stream *stream, size_t bytes,
+    size_t messages)
+{
+    limit_take(&stream->limit, bytes, messages);
+    if (stream->server)
+        limit_take(&stream->server->limit, bytes, messages);
+}
+
+static inline int stream_exhausted(struct sev_stream *stream)
+{
+    return limit_exhausted(&stream->limit) ||
+        (stream->server && limit_exhausted(&stream->server->limit));
+}
+
+// refills the limits, returns 1 if the stream must wait for more tokens
+static int stream_limited(struct sev_stream *stream)
+{
+    ev_tstamp now = ev_now(stream->loop->ev);
+
+    rate_refill(&stream->limit.bytes, now);
+    rate_refill(&stream->limit.messages, now);
+
+    if (stream->server) {
+        rate_refill(&stream->server->limit.bytes, now);
+        rate_refill(&stream->server->limit.messages, now);
+    }
+
+    return stream_exhausted(stream);
+}
+
+// bytes the limits allow for the next read
+static size_t stream_allowance(struct sev_stream *stream, size_t size)
+{
+    struct sev_rate *rates[2] = {&stream->limit.bytes,
+        stream->server ? &stream->server->limit.bytes : NULL};
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if (rates[i] && rates[i]->rate && rates[i]->tokens < size)
+            size = MAX((size_t)rates[i]->tokens, 1);
+    }
+
+    return size;
+}
+
+// stops reading while the stream is over its limits, returns 1 if it is
+static int stream_throttle(struct sev_stream *stream)
+{
+    if (stream->throttled)
+        return 1;
+
+    if (stream->closed || !stream_limited(stream))
+        return 0;
+
+    struct sev_loop *loop = stream->loop;
+
+    // kept around until throttle_cb() lets it go
+    stream->throttled = 1;
+    stream->throttled_next = loop->throttled;
+    loop->throttled = stream;
+    stream_hold(stream);
+
+    ev_io_stop(loop->ev, &stream->w_read);
+    COUNT(stream, throttles, 1);
+
+    if (!ev_is_active(&loop->w_throttle))
+        ev_timer_again(loop->ev, &loop->w_throttle);
+
+    return 1;
+}
+
+// starts the read watcher, handing out what's already buffered
+static void stream_resume_read(struct sev_stream *stream)
+{
+    if (stream->connector || stream->throttled)
+        return;
+
+    ev_io_start(stream->loop->ev, &stream->w_read);
+
+    // frames received before reads were blocked, or data already decrypted
+    if (stream->frame.stashed || tls_pending(stream))
+        ev_feed_event(stream->loop->ev, &stream->w_read, EV_READ);
+}
+
+// waits for its turn in schedule_cb()
+static void stream_ready(struct sev_stream *stream)
+{
+    struct sev_loop *loop = stream->loop;
+
+    ev_io_stop(loop->ev, &stream->w_read);
+
+    if (stream->ready)
+        return;
+
+    stream->ready = 1;
+    stream->ready_next = NULL;
+
+    if (loop->ready_tail)
+        loop->ready_tail->ready_next = stream;
+    else
+        loop->ready = stream;
+
+    loop->ready_tail = stream;
+    stream_hold(stream);
+
+    // no blocking while there's reading to do
+    ev_idle_start(loop->ev, &loop->w_ready);
+}
+
+static int frame_cb(void *data, char *payload, size_t len)
+{
+    struct sev_stream *stream = data;
+
+    if (stream->read_cb) {
+        uint64_t start = callback_start(stream->loop);
+        uint64_t timed = timing_start(stream);
+        stream->read_cb(stream, payload, len);
+        timing_end(stream, timed);
+        callback_end(stream->loop, start);
+    }
+
+    stream_take(stream, 0, 1);
+
+    return stream->closed || !stream->reading || stream_exhausted(stream);
+}
+
+// returns -1 if the stream should stop reading
+static int stream_deliver(struct sev_stream *stream, char *data, size_t len)
+{
+    if (stream->frame.mode == SEV_FRAME_NONE) {
+        if (stream->read_cb) {
+            uint64_t start = callback_start(stream->loop);
+            uint64_t timed = timing_start(stream);
+            stream->read_cb(stream, data, len);
+            timing_end(stream, timed);
+            callback_end(stream->loop, start);
+        }
+
+        stream_take(stream, 0, 1);
+    }
+    else if (sev_frame_feed(&stream->frame, &stream->loop->buffers, data, len,
+            frame_cb, stream) == -1) {
+        stream_close(stream, errno == EMSGSIZE ?
+            SEV_CLOSE_FRAME : SEV_CLOSE_ERROR, strerror(errno));
+        return -1;
+    }
+
+    return stream->closed || !stream->reading || stream_exhausted(stream) ?
+        -1 : 0;
+}
+
+// recv(), picking up the receive time when timestamping
+static ssize_t stream_recv(struct sev_stream *stream, char *buffer,
+    size_t size)
+{
+    if (!stream->timestamps)
+        return recv(stream->sd, buffer, size, 0);
+
+    char control[CMSG_SPACE(sizeof(struct scm_timestamping))];
+    struct iovec iov = {buffer, size};
+    struct msghdr msg = {};
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n = recvmsg(stream->sd, &msg, 0);
+    if (n > 0)
+        stream->arrival = control_time(&msg);
+
+    return n;
+}
+
+// returns 1 if the budget ran out before the socket was drained
+static int stream_read(struct sev_stream *stream, size_t budget, int calls)
+{
+    // frames left over from when reading was blocked
+    if (!stream_throttle(stream) && stream->frame.stashed &&
+            stream_deliver(stream, NULL, 0) == -1)
+        stream_throttle(stream);
+
+    // keep reading until the socket is drained or the budget is used up, so
+    // other streams get their turn
+    while (calls-- > 0 && budget > 0) {
+        if (stream->closed || !stream->reading || stream_throttle(stream))
+            return 0;
+
+        size_t size;
+        char *buffer = stream_recv_buffer(stream, &size);
+
+        // the application has nowhere to put more data for now
+        if (stream->recv_mode == SEV_RECV_USER && (!buffer || !size)) {
+            sev_block_read(stream);
+            return 0;
+        }
+
+        if (!buffer) {
+            stream_error(stream, ENOMEM);
+            return 0;
+        }
+
+        // messages can't be split
+        if (!stream->packets)
+            size = stream_allowance(stream, MIN(size, budget));
+
+        ssize_t n;
+
+#ifdef SEV_TLS
+        if (tls_recv_ssl(stream))
+            n = tls_recv(stream, buffer, size);
+        else
+#endif
+        n = stream_recv(stream, buffer, size);
+
+        COUNT(stream, reads, 1);
+
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EINTR) {
+                COUNT(stream, read_eagain, 1);
+                return 0;
+            }
+
+            // error
+            stream_error(stream, errno);
+            return 0;
+        }
+
+        if (n == 0) {
+            // client disconnected
+            stream_error(stream, ECONNRESET);
+            return 0;
+        }
+
+        COUNT(stream, bytes_in, n);
+        stream_take(stream, n, 0);
+        budget -= MIN((size_t)n, budget);
+        stream->last_read = ev_now(stream->loop->ev);
+        stream_touch(stream);
+
+        if (stream->recv_mode == SEV_RECV_BUF)
+            stream->recv_buf->len = n;
+
+        int ret = stream_deliver(stream, buffer, n);
+
+        // kept by the application, the next read gets a new one
+        if (stream->recv_mode == SEV_RECV_BUF &&
+                sev_buf_shared(stream->recv_buf)) {
+            sev_buf_release(stream->recv_buf);
+            stream->recv_buf = NULL;
+        }
+
+        if (ret == -1) {
+            stream_throttle(stream);
+            return 0;
+        }
+
+        // a short read means the socket buffer is empty, TLS hands out
+        // a record at a time though
+        if (n < size && !stream->packets && !tls_recv_ssl(stream))
+            return 0;
+    }
+
+#ifdef SEV_TLS
+    // decrypted data doesn't show up as socket readiness
+    if (tls_recv_ssl(stream) && sev_tls_pending(stream->tls))
+        ev_feed_event(stream->loop->ev, &stream->w_read, EV_READ);
+#endif
+
+    return 1;
+}
+
+static void stream_cb(EV_P_ struct ev_io *watcher, int revents)
+{
+    struct sev_stream *stream = watcher->data;
+
+    if (revents & EV_ERROR) {
+        stream_error(stream, errno);
+        return;
+    }
+
+    stream_hold(stream);
+
+    // completions and timestamps show up as an error condition on the socket
+    if (stream->zerocopy_pending || stream->tx_inflight)
+        errqueue_reap(stream);
+
+#ifdef SEV_TLS
+    if (tls_handshaking(stream))
+        tls_handshake(stream);
+    else
+#endif
+#ifdef SEV_URING
+    // only fed by sev_allow_read(), reads complete on the ring
+    if (stream->io && (revents & EV_READ))
+        uring_resume(stream);
+    else
+#endif
+    if ((revents & EV_READ) && stream->loop->read_budget)
+        stream_ready(stream);
+    else if (revents & EV_READ)
+        stream_read(stream, stream->read_budget, stream->read_calls);
+    else if (revents & EV_WRITE)
+        stream_write(stream);
+
+    stream_release(stream);
+}
+
+static struct sev_stream *stream_alloc(struct sev_loop *loop,
+    struct sev_pool *pool)
+{
+    // initialize sev_stream structure
+    struct sev_stream *stream = sev_pool_get(pool);
+    if (!stream)
+        return NULL;
+
+    memset(stream, 0, sizeof(struct sev_stream));
+
+    stream->sd = -1;
+    stream->loop = loop;
+    stream->high_watermark = SEND_HIGH_WATERMARK;
+    stream->low_watermark = SEND_LOW_WATERMARK;
+    stream->send_limit = SEND_BUFFER_LIMIT;
+    stream->recv_size = STREAM_RECV_SIZE;
+    stream->read_budget = STREAM_READ_BUDGET;
+    stream->read_calls = STREAM_READ_CALLS;
+    stream->connect_timeout = CONNECT_TIMEOUT;
+    stream->last_read = ev_now(loop->ev);
+    stream->last_write = stream->last_read;
+
+    ev_io_init(&stream->w_read, stream_cb, -1, EV_READ);
+    ev_io_init(&stream->w_write, stream_cb, -1, EV_WRITE);
+    stream->w_read.data = stream;
+    stream->w_write.data = stream;
+
+    return stream;
+}
+
+// fills a unix socket address, a leading '@' means the abstract namespace;
+// returns the address length or 0 if the path doesn't fit
+static socklen_t unix_address(struct sockaddr_un *addr, const char *path)
+{
+    size_t len = strlen(path);
+
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+
+    if (len == 0 || len >= sizeof(addr->sun_path))
+        return 0;
+
+    memcpy(addr->sun_path, path, len);
+
+    // abstract names aren't null terminated
+    if (path[0] == '@') {
+        addr->sun_path[0] = '\0';
+        return offsetof(struct sockaddr_un, sun_path) + len;
+    }
+
+    return offsetof(struct sockaddr_un, sun_path) + len + 1;
+}
+
+// the reverse of unix_address(), for remote_address
+static void unix_name(struct sockaddr_un *addr, char *name)
+{
+    int max = INET6_ADDRSTRLEN - 1;
+
+    // the address is zero filled past its length
+    if (addr->sun_path[0] == '\0' && addr->sun_path[1] != '\0') {
+        snprintf(name, INET6_ADDRSTRLEN, "@%.*s", max - 1, addr->sun_path + 1);
+        return;
+    }
+
+    snprintf(name, INET6_ADDRSTRLEN, "%.*s", max, addr->sun_path);
+}
+
+// starts watching a connected socket
+static void stream_attach(struct sev_stream *stream, int sd,
+    struct sockaddr *addr)
+{
+    stream->sd = sd;
+
+    if (addr->sa_family == AF_UNIX) {
+        unix_name((struct sockaddr_un *)addr, stream->remote_address);
+        stream->remote_port = 0;
+    }
+    else if (addr->sa_family == AF_INET6) {
+        struct sockaddr_in6 *s_in6 = (struct sockaddr_in6 *)addr;
+        stream->remote_port = ntohs(s_in6->sin6_port);
+        inet_ntop(AF_INET6, &s_in6->sin6_addr, stream->remote_address,
+            INET6_ADDRSTRLEN);
+    }
+    else {
+        struct sockaddr_in *s_in = (struct sockaddr_in *)addr;
+        stream->remote_port = ntohs(s_in->sin_port);
+        inet_ntop(AF_INET, &s_in->sin_addr, stream->remote_address,
+            INET6_ADDRSTRLEN);
+    }
+
+    // register with libev
+    ev_io_set(&stream->w_read, sd, EV_READ);
+    ev_io_set(&stream->w_write, sd, EV_WRITE);
+
+#ifdef SEV_TLS
+    // TLS streams stay on libev, servers wait for the client hello
+    if (stream->tls) {
+        ev_io_start(stream->loop->ev, &stream->w_read);
+        return;
+    }
+#endif
+
+#ifdef SEV_URING
+    // falls back to libev if there is no memory for the ring state
+    if (stream->loop->engine && uring_attach(stream) == 0) {
+        if (stream->reading)
+            uring_recv(stream);
+
+        if (stream->writing)
+            uring_send(stream);
+
+        return;
+    }
+#endif
+
+    if (stream->reading)
+        ev_io_start(stream->loop->ev, &stream->w_read);
+
+    if (stream->writing)
+        ev_io_start(stream->loop->ev, &stream->w_write);
+}
+
+// the watcher is started by stream_attach() if still connecting
+static void stream_want_write(struct sev_stream *stream)
+{
+    if (stream->writing)
+        return;
+
+    stream->writing = 1;
+
+    // the write timeout counts from here
+    stream->last_write = ev_now(stream->loop->ev);
+    stream_touch(stream);
+
+    if (stream->connector || tls_handshaking(stream))
+        return;
+
+#ifdef SEV_URING
+    if (stream->io) {
+        uring_send(stream);
+        return;
+    }
+#endif
+
+    ev_io_start(stream->loop->ev, &stream->w_write);
+}
+
+static void server_accept(struct sev_server *server, int sd,
+    struct sockaddr *addr)
+{
+    struct sev_stream *stream = stream_alloc(server->loop, &server->streams);
+    if (!stream) {
+        close(sd);
+        return;
+    }
+
+#ifdef SEV_TLS
+    if (server->tls) {
+        stream->tls = sev_tls_new(server->tls, sd, 0, NULL);
+        if (!stream->tls) {
+            close(sd);
+            sev_pool_put(stream);
+            return;
+        }
+    }
+#endif
+
+    // not inherited from the listener
+    if (server->sockopts.quickack) {
+        int flag = 1;
+        setsockopt(sd, IPPROTO_TCP, TCP_QUICKACK, &flag, sizeof(flag));
+    }
+
+    stream->reading = 1;
+    stream_attach(stream, sd, addr);
+
+    stream->server = server;
+    stream->live_next = server->live;
+    if (server->live)
+        server->live->live_prev = stream;
+    server->live = stream;
+
+    // initialize callbacks
+    stream->read_cb = server->read_cb;
+    stream->close_cb = server->close_cb;
+    stream->pause_cb = server->pause_cb;
+    stream->drain_cb = server->drain_cb;
+    stream->sendfile_cb = server->sendfile_cb;
+
+    if (server->high_watermark)
+        stream->high_watermark = server->high_watermark;
+    if (server->low_watermark)
+        stream->low_watermark = server->low_watermark;
+    if (server->send_limit)
+        stream->send_limit = server->send_limit;
+    if (server->recv_size > 1)
+        stream->recv_size = server->recv_size;
+    if (server->read_budget)
+        stream->read_budget = server->read_budget;
+    if (server->read_calls)
+        stream->read_calls = server->read_calls;
+
+    stream->recv_mode = server->recv_mode;
+    stream->alloc_cb = server->alloc_cb;
+    stream->limit = server->stream_limit;
+    stream->weight = server->weight;
+    stream->idle_timeout = server->idle_timeout;
+    stream->read_timeout = server->read_timeout;
+    stream->write_timeout = server->write_timeout;
+    stream->frame = server->frame;
+    stream->corked = server->corked;
+    stream->zerocopy_threshold = server->zerocopy_threshold;
+    stream->packets = server->packets;
+
+    if (server->timestamps)
+        sev_stream_timestamps(stream, server->tx_sample);
+
+    // call open callback
+    stream_hold(stream);
+
+    if (server->open_cb) {
+        uint64_t start = callback_start(server->loop);
+        server->open_cb(stream);
+        callback_end(server->loop, start);
+    }
+
+    // pick up any timeouts set by open_cb
+    if (stream_release(stream) == 0)
+        stream_schedule(stream);
+}
+
+// out of descriptors or memory, accepting again right away would spin
+static int accept_exhausted(int error)
+{
+    return error == EMFILE || error == ENFILE || error == ENOBUFS ||
+        error == ENOMEM;
+}
+
+static void accept_resume_cb(EV_P_ struct ev_timer *watcher, int revents)
+{
+    struct sev_server *server = watcher->data;
+
+#ifdef SEV_URING
+    if (server->loop->engine) {
+        uring_accept(server);
+        return;
+    }
+#endif
+
+    ev_io_start(EV_A_ &server->watcher);
+}
+
+// the backlog keeps filling up in the meantime
+static void accept_pause(struct sev_server *server)
+{
+    ev_io_stop(server->loop->ev, &server->watcher);
+    ev_timer_set(&server->w_accept, ACCEPT_BACKOFF, 0);
+    ev_timer_start(server->loop->ev, &server->w_accept);
+}
+
+static void accept_cb(EV_P_ struct ev_io *watcher, int revents)
+{
+    struct sev_server *server = watcher->data;
+    int budget = server->accept_budget > 0 ?
+        server->accept_budget : ACCEPT_BUDGET;
+
+    // drain the backlog, up to the budget so streams get their turn too
+    while (budget-- > 0) {
+        // accept client socket
+        struct sockaddr_storage addr = {};
+        socklen_t addr_len = sizeof(addr);
+
+        // non-blocking and nodelay come with the socket, see listen_socket()
+        int sd = accept4(watcher->fd, (struct sockaddr *)&addr, &addr_len,
+            SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (sd == -1) {
+            if (accept_exhausted(errno))
+                accept_pause(server);
+            return;
+        }
+
+        server->stats.accepts++;
+        server->loop->stats.accepts++;
+        server_accept(server, sd, (struct sockaddr *)&addr);
+    }
+}
+
+// socket tuning
+
+static void sockopt(struct sev_sockopts *opts, int sd, int level, int name,
+    int value, unsigned bit)
+{
+    if (setsockopt(sd, level, name, &value, sizeof(value)) == 0)
+        opts->applied |= bit;
+    else
+        opts->failed |= bit;
+}
+
+// buffer sizes have to be set before listen() or connect() to be used for
+// window scaling
+static void sockopts_apply(struct sev_sockopts *opts, int sd, int listening)
+{
+    if (opts->rcvbuf)
+        sockopt(opts, sd, SOL_SOCKET, SO_RCVBUF, opts->rcvbuf, SEV_OPT_RCVBUF);
+
+    if (opts->sndbuf)
+        sockopt(opts, sd, SOL_SOCKET, SO_SNDBUF, opts->sndbuf, SEV_OPT_SNDBUF);
+
+    if (opts->defer_accept && listening) {
+        sockopt(opts, sd, IPPROTO_TCP, TCP_DEFER_ACCEPT, opts->defer_accept,
+            SEV_OPT_DEFER_ACCEPT);
+    }
+
+    // the queue length of pending fast opens, or data in the syn
+    if (opts->fastopen) {
+        if (listening) {
+            sockopt(opts, sd, IPPROTO_TCP, TCP_FASTOPEN, opts->fastopen,
+                SEV_OPT_FASTOPEN);
+        }
+        else {
+            sockopt(opts, sd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1,
+                SEV_OPT_FASTOPEN);
+        }
+    }
+
+    if (opts->notsent_lowat) {
+        sockopt(opts, sd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, opts->notsent_lowat,
+            SEV_OPT_NOTSENT_LOWAT);
+    }
+
+    if (opts->busy_poll) {
+        sockopt(opts, sd, SOL_SOCKET, SO_BUSY_POLL, opts->busy_poll,
+            SEV_OPT_BUSY_POLL);
+    }
+
+    if (opts->quickack)
+        sockopt(opts, sd, IPPROTO_TCP, TCP_QUICKACK, 1, SEV_OPT_QUICKACK);
+
+    if (opts->incoming_cpu) {
+        sockopt(opts, sd, SOL_SOCKET, SO_INCOMING_CPU, opts->incoming_cpu - 1,
+            SEV_OPT_INCOMING_CPU);
+    }
+
+    if (opts->keepalive) {
+        sockopt(opts, sd, SOL_SOCKET, SO_KEEPALIVE, 1, SEV_OPT_KEEPALIVE);
+        sockopt(opts, sd, IPPROTO_TCP, TCP_KEEPIDLE, opts->keepalive,
+            SEV_OPT_KEEPALIVE);
+
+        if (opts->keepalive_interval) {
+            sockopt(opts, sd, IPPROTO_TCP, TCP_KEEPINTVL,
+                opts->keepalive_interval, SEV_OPT_KEEPALIVE);
+        }
+
+        if (opts->keepalive_count) {
+            sockopt(opts, sd, IPPROTO_TCP, TCP_KEEPCNT, opts->keepalive_count,
+                SEV_OPT_KEEPALIVE);
+        }
+
+        // partly applied is failed
+        if (opts->failed & SEV_OPT_KEEPALIVE)
+            opts->applied &= ~SEV_OPT_KEEPALIVE;
+    }
+
+    // disable nagle's algorithm unless asked not to
+    if (opts->nagle)
+        opts->applied |= SEV_OPT_NAGLE;
+    else
+        sockopt(opts, sd, IPPROTO_TCP, TCP_NODELAY, 1, 0);
+}
+
+// outgoing connections
+
+struct attempt {
+    int sd;
+    struct ev_io watcher;
+    struct sev_connector *connector;
+};
+
+struct sev_connector {
+    struct sev_stream *stream;
+    int port;
+    int type;
+
+    // see sev_connect_opts()
+    struct sev_sockopts *opts;
+    ev_tstamp started;
+
+    // name lookup in progress
+    struct sev_resolve *req;
+
+    // addresses in the order they are tried, one attempt per address
+    struct sev_addrlist addrs;
+    struct attempt attempts[RESOLVE_MAX_ADDRS];
+    int next;
+    int pending;
+    int error;
+
+    struct ev_timer w_delay;
+
+#ifdef SEV_TLS
+    // see sev_tls_connect()
+    SSL_CTX *tls;
+    char *hostname;
+#endif
+};
+
+static void connector_free(struct sev_connector *connector)
+{
+    struct ev_loop *ev = connector->stream->loop->ev;
+    int i;
+
+    if (connector->req)
+        sev_resolve_cancel(connector->req);
+
+    for (i = 0; i < connector->next; i++) {
+        struct attempt *attempt = &connector->attempts[i];
+
+        if (attempt->sd != -1) {
+            ev_io_stop(ev, &attempt->watcher);
+            close(attempt->sd);
+        }
+    }
+
+    ev_timer_stop(ev, &connector->w_delay);
+
+#ifdef SEV_TLS
+    free(connector->hostname);
+#endif
+
+    connector->stream->connector = NULL;
+    free(connector);
+}
+
+static void connector_fail(struct sev_connector *connector,
+    enum sev_close_code code, const char *reason)
+{
+    struct sev_stream *stream = connector->stream;
+
+    connector_free(connector);
+
+    stream_hold(stream);
+
+    if (stream->connect_cb)
+        stream->connect_cb(stream, reason);
+
+    stream_close(stream, code, reason);
+    stream_release(stream);
+}
+
+static void connector_done(struct sev_connector *connector,
+    struct attempt *winner)
+{
+    struct sev_stream *stream = connector->stream;
+    int sd = winner->sd;
+    struct sockaddr_storage addr =
+        connector->addrs.addrs[winner - connector->attempts];
+
+#ifdef SEV_TLS
+    if (connector->tls) {
+        stream->tls = sev_tls_new(connector->tls, sd, 1, connector->hostname);
+        if (!stream->tls) {
+            connector_fail(connector, SEV_CLOSE_CONNECT, strerror(ENOMEM));
+            return;
+        }
+    }
+#endif
+
+    // keep the winning socket out of connector_free()
+    ev_io_stop(stream->loop->ev, &winner->watcher);
+    winner->sd = -1;
+
+    connector_free(connector);
+
+    stream_attach(stream, sd, (struct sockaddr *)&addr);
+
+#ifdef SEV_TLS
+    // connect_cb waits for the handshake
+    if (stream->tls) {
+        stream_hold(stream);
+        tls_handshake(stream);
+        stream_release(stream);
+        return;
+    }
+#endif
+
+    if (stream->connect_cb) {
+        stream_hold(stream);
+        stream->connect_cb(stream, NULL);
+        stream_release(stream);
+    }
+}
+
+static void attempt_cb(EV_P_ struct ev_io *watcher, int revents);
+
+// starts connecting to the next address, gives up once none are left
+static void connector_next(struct sev_connector *connector)
+{
+    struct ev_loop *ev = connector->stream->loop->ev;
+
+    while (connector->next < connector->addrs.count) {
+        int i = connector->next++;
+        struct attempt *attempt = &connector->attempts[i];
+        struct sockaddr *addr = (struct sockaddr *)&connector->addrs.addrs[i];
+
+        attempt->sd = -1;
+        attempt->connector = connector;
+
+        if (addr->sa_family == AF_INET6)
+            ((struct sockaddr_in6 *)addr)->sin6_port = htons(connector->port);
+        else if (addr->sa_family == AF_INET)
+            ((struct sockaddr_in *)addr)->sin_port = htons(connector->port);
+
+        int sd = socket(addr->sa_family,
+            connector->type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+        if (sd == -1) {
+            connector->error = errno;
+            continue;
+        }
+
+        // disable nagle's algorithm, unless tuned otherwise
+        if (connector->opts && addr->sa_family != AF_UNIX)
+            sockopts_apply(connector->opts, sd, 0);
+        else if (addr->sa_family != AF_UNIX) {
+            int flag = 1;
+            setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+        }
+
+        // the outcome is picked up in attempt_cb either way
+        if (connect(sd, addr, connector->addrs.lens[i]) == -1 &&
+                errno != EINPROGRESS) {
+            connector->error = errno;
+            close(sd);
+            continue;
+        }
+
+        attempt->sd = sd;
+        ev_io_init(&attempt->watcher, attempt_cb, sd, EV_WRITE);
+        attempt->watcher.data = attempt;
+        ev_io_start(ev, &attempt->watcher);
+        connector->pending++;
+
+        // give this address a head start before racing the next one
+        if (connector->next < connector->addrs.count) {
+            ev_timer_set(&connector->w_delay, CONNECT_ATTEMPT_DELAY, 0.);
+            ev_timer_start(ev, &connector->w_delay);
+        }
+
+        return;
+    }
+
+    if (connector->pending == 0) {
+        connector_fail(connector, SEV_CLOSE_CONNECT,
+            strerror(connector->error ?
+            connector->error : EHOSTUNREACH));
+    }
+}
+
+static void attempt_cb(EV_P_ struct ev_io *watcher, int revents)
+{
+    struct attempt *attempt = watcher->data;
+    struct sev_connector *connector = attempt->connector;
+
+    int error = 0;
+    socklen_t len = sizeof(error);
+
+    if (getsockopt(attempt->sd, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+        error = errno;
+
+    if (!error) {
+        connector_done(connector, attempt);
+        return;
+    }
+
+    ev_io_stop(EV_A_ watcher);
+    close(attempt->sd);
+    attempt->sd = -1;
+
+    connector->pending--;
+    connector->error = error;
+
+    // move on to the next address without waiting for the head start
+    ev_timer_stop(EV_A_ &connector->w_delay);
+    connector_next(connector);
+}
+
+static void delay_cb(EV_P_ struct ev_timer *watcher, int revents)
+{
+    connector_next(watcher->data);
+}
+
+static void resolve_cb(void *data, int error, struct sev_addrlist *addrs)
+{
+    struct sev_connector *connector = data;
+    connector->req = NULL;
+
+    if (error) {
+        connector_fail(connector, SEV_CLOSE_CONNECT, gai_strerror(error));
+        return;
+    }
+
+    // alternate address families, starting with the preferred one
+    int family = addrs->addrs[0].ss_family;
+    int same = 0, other = 0, k;
+
+    for (k = 0; k < addrs->count; k++) {
+        while (same < addrs->count && addrs->addrs[same].ss_family != family)
+            same++;
+        while (other < addrs->count && addrs->addrs[other].ss_family == family)
+            other++;
+
+        int pick = ((k % 2 == 0 && same < addrs->count) ||
+            other == addrs->count) ? same++ : other++;
+
+        connector->addrs.addrs[k] = addrs->addrs[pick];
+        connector->addrs.lens[k] = addrs->lens[pick];
+    }
+
+    connector->addrs.count = addrs->count;
+
+    connector_next(connector);
+}
+
+// io_uring engine
+
+#ifdef SEV_URING
+
+// operation kinds, kept in the low bits of the user_data pointer
+#define OP_ACCEPT 0
+#define OP_RECV 1
+#define OP_SEND 2
+#define OP_CANCEL 3
+#define OP_MASK 3
+
+struct sev_engine {
+    struct sev_uring ring;
+
+    // completions were posted
+    struct ev_io w_ring;
+
+    // submits everything queued during the iteration with one syscall
+    struct ev_prepare w_submit;
+
+    // operations that keep the loop alive, like an active watcher would
+    int active;
+
+    // servers that found the submission queue full re-arming their accept
+    struct sev_server *accepting;
+
+    // streams that found it full cancelling an operation, held until then
+    struct sev_stream *cancelling;
+
+    // per stream state
+    struct sev_pool ios;
+};
+
+// a sendmsg over the front of the queue, only allocated while in flight
+struct uring_send {
+    struct msghdr msg;
+    struct iovec iov[SEND_IOV_MAX];
+    size_t len;
+};
+
+struct sev_stream_io {
+    int recv_armed;
+    struct uring_send *sending;
+
+    // received after reads were blocked, before the receive was cancelled
+    char *held;
+    size_t held_len;
+    size_t held_size;
+
+    // operations waiting for room to be cancelled, one bit per kind
+    unsigned cancels;
+    struct sev_stream *cancel_next;
+};
+
+static inline uint64_t op_data(void *ptr, int op)
+{
+    return (uint64_t)(uintptr_t)ptr | op;
+}
+
+static struct io_uring_sqe *uring_sqe(struct sev_loop *loop)
+{
+    return sev_uring_sqe(&loop->engine->ring);
+}
+
+static void uring_ref(struct sev_loop *loop)
+{
+    if (loop->engine->active++ == 0)
+        ev_ref(loop->ev);
+}
+
+static void uring_unref(struct sev_loop *loop)
+{
+    if (--loop->engine->active == 0)
+        ev_unref(loop->ev);
+}
+
+static int uring_attach(struct sev_stream *stream)
+{
+    struct sev_stream_io *io = sev_pool_get(&stream->loop->engine->ios);
+    if (!io)
+        return -1;
+
+    memset(io, 0, sizeof(struct sev_stream_io));
+    stream->io = io;
+
+    return 0;
+}
+
+static void uring_detach(struct sev_stream *stream)
+{
+    struct sev_stream_io *io = stream->io;
+
+    if (io->held)
+        sev_buffer_put(&stream->loop->buffers, io->held, io->held_size);
+
+    sev_pool_put(io);
+    stream->io = NULL;
+}
+
+// multishot, completes once per read into a buffer picked by the kernel
+static void uring_recv(struct sev_stream *stream)
+{
+    struct io_uring_sqe *sqe = uring_sqe(stream->loop);
+    if (!sqe) {
+        stream_error(stream, EBUSY);
+        return;
+    }
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = stream->sd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = op_data(stream, OP_RECV);
+
+    stream->io->recv_armed = 1;
+    stream_hold(stream);
+    uring_ref(stream->loop);
+}
+
+// one sendmsg in flight per stream keeps the data in order
+static void uring_send(struct sev_stream *stream)
+{
+    struct sev_stream_io *io = stream->io;
+
+    if (io->sending || ev_is_active(&stream->w_write) || !stream->queue.head)
+        return;
+
+    // files go through sendfile() on readiness, see stream_write()
+    if (stream->queue.head->fd != -1) {
+        ev_io_start(stream->loop->ev, &stream->w_write);
+        return;
+    }
+
+    struct uring_send *send = sev_buffer_get(&stream->loop->buffers,
+        sizeof(struct uring_send));
+    struct io_uring_sqe *sqe = send ? uring_sqe(stream->loop) : NULL;
+
+    if (!sqe) {
+        if (send) {
+            sev_buffer_put(&stream->loop->buffers, send,
+                sizeof(struct uring_send));
+        }
+
+        stream_error(stream, send ? EBUSY : ENOMEM);
+        return;
+    }
+
+    int i;
+
+    memset(&send->msg, 0, sizeof(struct msghdr));
+    send->msg.msg_iov = send->iov;
+    send->msg.msg_iovlen = sev_queue_iov(&stream->queue, send->iov,
+        stream->packets ? 1 : SEND_IOV_MAX);
+    send->len = 0;
+
+    for (i = 0; i < send->msg.msg_iovlen; i++)
+        send->len += send->iov[i].iov_len;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = stream->sd;
+    sqe->addr = (uintptr_t)&send->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = op_data(stream, OP_SEND);
+
+    io->sending = send;
+    stream_hold(stream);
+    uring_ref(stream->loop);
+}
+
+static void uring_cancel(struct sev_stream *stream, int op)
+{
+    struct sev_engine *engine = stream->loop->engine;
+    struct sev_stream_io *io = stream->io;
+    struct io_uring_sqe *sqe = uring_sqe(stream->loop);
+
+    // retried once submit_cb() made room, the operation would otherwise
+    // keep the stream forever
+    if (!sqe) {
+        if (!io->cancels) {
+            io->cancel_next = engine->cancelling;
+            engine->cancelling = stream;
+            stream_hold(stream);
+        }
+        io->cancels |= 1 << op;
+        return;
+    }
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = op_data(stream, op);
+    sqe->user_data = op_data(NULL, OP_CANCEL);
+}
+
+static void uring_accept(struct sev_server *server)
+{
+    struct sev_engine *engine = server->loop->engine;
+    struct io_uring_sqe *sqe = uring_sqe(server->loop);
+
+    // retried once submit_cb() made room, counts as armed until then
+    if (!sqe) {
+        if (!server->accept_waiting) {
+            server->accept_waiting = 1;
+            server->accept_next = engine->accepting;
+            engine->accepting = server;
+            uring_ref(server->loop);
+        }
+        return;
+    }
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = server->sd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = op_data(server, OP_ACCEPT);
+
+    uring_ref(server->loop);
+}
+
+// keeps data for when reads are allowed again
+static int uring_hold(struct sev_stream *stream, const char *data, size_t len)
+{
+    struct sev_stream_io *io = stream->io;
+    size_t need = io->held_len + len + 1;
+
+    if (need > io->held_size) {
+        size_t size = sev_buffer_size(need);
+        char *held = sev_buffer_get(&stream->loop->buffers, size);
+        if (!held)
+            return -1;
+
+        if (io->held) {
+            memcpy(held, io->held, io->held_len);
+            sev_buffer_put(&stream->loop->buffers, io->held, io->held_size);
+        }
+
+        io->held = held;
+        io->held_size = size;
+    }
+
+    memcpy(io->held + io->held_len, data, len);
+    io->held_len += len;
+
+    return 0;
+}
+
+// reads were allowed again
+static void uring_resume(struct sev_stream *stream)
+{
+    struct sev_stream_io *io = stream->io;
+
+    if (stream->frame.stashed && stream_deliver(stream, NULL, 0) == -1)
+        return;
+
+    if (io->held_len) {
+        char *held = io->held;
+        size_t len = io->held_len;
+        size_t size = io->held_size;
+
+        io->held = NULL;
+        io->held_len = 0;
+        io->held_size = 0;
+
+        int ret = stream_deliver(stream, held, len);
+        sev_buffer_put(&stream->loop->buffers, held, size);
+
+        if (ret == -1)
+            return;
+    }
+
+    if (stream->reading && !io->recv_armed)
+        uring_recv(stream);
+}
+
+static void uring_received(struct sev_stream *stream, int res,
+    unsigned flags)
+{
+    struct sev_uring *ring = &stream->loop->engine->ring;
+    struct sev_stream_io *io = stream->io;
+
+    // the multishot receive ended, it is armed again below if needed
+    if (!(flags & IORING_CQE_F_MORE))
+        io->recv_armed = 0;
+
+    if (flags & IORING_CQE_F_BUFFER) {
+        unsigned id = flags >> IORING_CQE_BUFFER_SHIFT;
+
+        if (res > 0 && !stream->closed) {
+            char *buffer = sev_uring_buffer(ring, id);
+
+            COUNT(stream, reads, 1);
+            COUNT(stream, bytes_in, res);
+            stream->last_read = ev_now(stream->loop->ev);
+            stream_touch(stream);
+
+            if (!stream->reading) {
+                if (uring_hold(stream, buffer, res) == -1)
+                    stream_error(stream, ENOMEM);
+            }
+            else {
+                stream_deliver(stream, buffer, res);
+            }
+        }
+
+        sev_uring_buffer_put(ring, id);
+    }
+    else if (res == 0 && !stream->closed) {
+        // client disconnected
+        stream_error(stream, ECONNRESET);
+    }
+    else if (res < 0 && res != -ENOBUFS && res != -ECANCELED &&
+            !stream->closed) {
+        stream_error(stream, -res);
+    }
+
+    if (!io->recv_armed && stream->reading && !stream->closed)
+        uring_recv(stream);
+
+    if (!(flags & IORING_CQE_F_MORE)) {
+        uring_unref(stream->loop);
+        stream_release(stream);
+    }
+}
+
+static void uring_sent(struct sev_stream *stream, int res)
+{
+    struct sev_stream_io *io = stream->io;
+    size_t len = io->sending->len;
+
+    sev_buffer_put(&stream->loop->buffers, io->sending,
+        sizeof(struct uring_send));
+    io->sending = NULL;
+
+    if (stream->closed) {
+        stream_drop_queue(stream);
+    }
+    else if (res < 0) {
+        stream_error(stream, -res);
+    }
+    else {
+        COUNT(stream, writes, 1);
+        COUNT(stream, bytes_out, res);
+
+        if (res < len)
+            COUNT(stream, partial_writes, 1);
+
+        sev_queue_consume(&stream->queue, &stream->loop->buffers, res);
+        stream->last_write = ev_now(stream->loop->ev);
+
+        stream_wrote(stream);
+
+        if (!stream->closed)
+            uring_send(stream);
+    }
+
+    uring_unref(stream->loop);
+    stream_release(stream);
+}
+
+static void uring_accepted(struct sev_server *server, int res,
+    unsigned flags)
+{
+    if (res >= 0) {
+        // multishot accept doesn't report addresses
+        struct sockaddr_storage addr = {};
+        socklen_t addr_len = sizeof(addr);
+        getpeername(res, (struct sockaddr *)&addr, &addr_len);
+
+        server->stats.accepts++;
+        server->loop->stats.accepts++;
+        server_accept(server, res, (struct sockaddr *)&addr);
+    }
+
+    if (!(flags & IORING_CQE_F_MORE)) {
+        uring_unref(server->loop);
+
+        if (res < 0 && accept_exhausted(-res))
+            accept_pause(server);
+        else
+            uring_accept(server);
+    }
+}
+
+static void ring_cb(EV_P_ struct ev_io *watcher, int revents)
+{
+    struct sev_loop *sloop = watcher->data;
+    struct sev_uring *ring = &sloop->engine->ring;
+    struct io_uring_cqe *cqe;
+
+    while ((cqe = sev_uring_cqe(ring))) {
+        uint64_t data = cqe->user_data;
+        int res = cqe->res;
+        unsigned flags = cqe->flags;
+
+        sev_uring_seen(ring);
+
+        void *ptr = (void *)(uintptr_t)(data & ~(uint64_t)OP_MASK);
+
+        switch (data & OP_MASK) {
+        case OP_ACCEPT:
+            uring_accepted(ptr, res, flags);
+            break;
+        case OP_RECV:
+            uring_received(ptr, res, flags);
+            break;
+        case OP_SEND:
+            uring_sent(ptr, res);
+            break;
+        }
+    }
+}
+
+static void submit_cb(EV_P_ struct ev_prepare *watcher, int revents)
+{
+    struct sev_loop *sloop = watcher->data;
+    struct sev_engine *engine = sloop->engine;
+
+    sev_uring_submit(&engine->ring);
+
+    if (!engine->accepting && !engine->cancelling)
+        return;
+
+    struct sev_server *server = engine->accepting;
+    engine->accepting = NULL;
+
+    while (server) {
+        struct sev_server *next = server->accept_next;
+
+        server->accept_waiting = 0;
+        uring_unref(sloop);
+        uring_accept(server);
+        server = next;
+    }
+
+    struct sev_stream *stream = engine->cancelling;
+    engine->cancelling = NULL;
+
+    while (stream) {
+        struct sev_stream_io *io = stream->io;
+        struct sev_stream *next = io->cancel_next;
+        unsigned cancels = io->cancels;
+        int op;
+
+        io->cancels = 0;
+        for (op = 0; op <= OP_MASK; op++) {
+            if (cancels & 1 << op)
+                uring_cancel(stream, op);
+        }
+
+        stream_release(stream);
+        stream = next;
+    }
+
+    sev_uring_submit(&engine->ring);
+}
+
+static int engine_start(struct sev_loop *loop)
+{
+    struct sev_engine *engine = calloc(1, sizeof(struct sev_engine));
+    if (!engine)
+        return -1;
+
+    if (sev_uring_init(&engine->ring, URING_ENTRIES) == -1) {
+        free(engine);
+        return -1;
+    }
+
+    if (sev_uring_buffers(&engine->ring, URING_BUFFERS,
+            URING_BUFFER_SIZE) == -1) {
+        sev_uring_free(&engine->ring);
+        free(engine);
+        return -1;
+    }
+
+    sev_pool_init(&engine->ios, sizeof(struct sev_stream_io),
+        STREAM_POOL_CAPACITY);
+
+    // neither watcher keeps the loop alive on its own
+    ev_io_init(&engine->w_ring, ring_cb, engine->ring.fd, EV_READ);
+    engine->w_ring.data = loop;
+    ev_io_start(loop->ev, &engine->w_ring);
+    ev_unref(loop->ev);
+
+    // after every other prepare watcher had its chance to queue work
+    ev_prepare_init(&engine->w_submit, submit_cb);
+    ev_set_priority(&engine->w_submit, EV_MINPRI);
+    engine->w_submit.data = loop;
+    ev_prepare_start(loop->ev, &engine->w_submit);
+    ev_unref(loop->ev);
+
+    loop->engine = engine;
+
+    return 0;
+}
+
+static void engine_stop(struct sev_loop *loop)
+{
+    struct sev_engine *engine = loop->engine;
+
+    if (engine->active == 0)
+        ev_ref(loop->ev);
+
+    ev_ref(loop->ev);
+    ev_io_stop(loop->ev, &engine->w_ring);
+    ev_prepare_stop(loop->ev, &engine->w_submit);
+
+    while (engine->accepting) {
+        engine->accepting->accept_waiting = 0;
+        engine->accepting = engine->accepting->accept_next;
+    }
+
+    while (engine->cancelling) {
+        struct sev_stream *stream = engine->cancelling;
+
+        engine->cancelling = stream->io->cancel_next;
+        stream->io->cancels = 0;
+        stream_release(stream);
+    }
+
+    sev_uring_free(&engine->ring);
+    sev_pool_clear(&engine->ios);
+    free(engine);
+    loop->engine = NULL;
+}
+
+#endif
+
+int sev_loop_engine(struct sev_loop *loop, enum sev_engine_type type)
+{
+    if (!loop)
+        loop = sev_loop_default();
+
+    if (type == SEV_ENGINE_LIBEV) {
+#ifdef SEV_URING
+        if (loop->engine)
+            engine_stop(loop);
+#endif
+        return 0;
+    }
+
+#ifdef SEV_URING
+    if (type == SEV_ENGINE_URING)
+        return loop->engine ? 0 : engine_start(loop);
+#endif
+
+    errno = ENOSYS;
+    return -1;
+}
+
+// TLS
+
+int sev_tls_connect(struct sev_stream *stream, struct ssl_ctx_st *ctx,
+    const char *hostname)
+{
+#ifdef SEV_TLS
+    struct sev_connector *connector = stream->connector;
+    if (!connector)
+        return -1;
+
+    char *copy = hostname ? strdup(hostname) : NULL;
+    if (hostname && !copy)
+        return -1;
+
+    free(connector->hostname);
+    connector->tls = ctx;
+    connector->hostname = copy;
+
+    return 0;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+#ifdef SEV_TLS
+
+static void tls_error(struct sev_stream *stream, int status)
+{
+    if (status == SEV_TLS_CLOSED)
+        stream_close(stream, SEV_CLOSE_PEER, "Connection closed");
+    else if (errno)
+        stream_error(stream, errno);
+    else
+        stream_close(stream, SEV_CLOSE_ERROR, sev_tls_error());
+}
+
+static void tls_handshake(struct sev_stream *stream)
+{
+    struct ev_loop *ev = stream->loop->ev;
+    int status = sev_tls_handshake(stream->tls);
+
+    if (status == SEV_TLS_WANT_READ) {
+        ev_io_stop(ev, &stream->w_write);
+        ev_io_start(ev, &stream->w_read);
+        return;
+    }
+
+    if (status == SEV_TLS_WANT_WRITE) {
+        ev_io_start(ev, &stream->w_write);
+        return;
+    }
+
+    if (status != SEV_TLS_OK) {
+        const char *reason = status == SEV_TLS_CLOSED ?
+            "Connection closed" : sev_tls_error();
+
+        if (!stream->server && stream->connect_cb)
+            stream->connect_cb(stream, reason);
+
+        // the reason is already out for clients
+        if (stream->server)
+            tls_error(stream, status);
+        else
+            stream_close(stream, SEV_CLOSE_CONNECT, reason);
+
+        return;
+    }
+
+    // back to the stream's own watchers
+    if (!stream->reading)
+        ev_io_stop(ev, &stream->w_read);
+
+    ev_io_stop(ev, &stream->w_write);
+    stream->writing = 0;
+
+    if (!stream->server && stream->connect_cb) {
+        stream->connect_cb(stream, NULL);
+        if (stream->closed)
+            return;
+    }
+
+    // data queued during the handshake
+    if (stream->queue.head)
+        stream_want_write(stream);
+
+    if (stream->reading && tls_pending(stream))
+        ev_feed_event(ev, &stream->w_read, EV_READ);
+}
+
+// recv() for user space TLS, errors other than EAGAIN have already closed
+// the stream
+static ssize_t tls_recv(struct sev_stream *stream, char *buffer, size_t size)
+{
+    size_t n;
+    int status = sev_tls_read(stream->tls, buffer, size, &n);
+
+    if (status == SEV_TLS_OK)
+        return n;
+
+    if (status == SEV_TLS_CLOSED)
+        return 0;
+
+    if (status == SEV_TLS_ERROR)
+        tls_error(stream, status);
+
+    errno = EAGAIN;
+    return -1;
+}
+
+// stream_write() through SSL_write(), files are read into a pooled buffer
+// a record at a time
+static void tls_write(struct sev_stream *stream)
+{
+    struct sev_buffer_pool *pool = &stream->loop->buffers;
+    char *record = NULL;
+
+    while (stream->queue.head) {
+        struct sev_chunk *chunk = stream->queue.head;
+        struct iovec iov;
+
+        if (chunk->fd != -1) {
+            if (chunk->start == chunk->end) {
+                if (stream_file_sent(stream) == -1)
+                    break;
+                continue;
+            }
+
+            if (!record && !(record = sev_buffer_get(pool, TLS_RECORD_SIZE))) {
+                stream_error(stream, ENOMEM);
+                return;
+            }
+
+            ssize_t r = pread(chunk->fd, record,
+                MIN(chunk->end - chunk->start, TLS_RECORD_SIZE), chunk->start);
+
+            if (r <= 0) {
+                if (r == 0)
+                    stream_close(stream, SEV_CLOSE_ERROR, "Unexpected end of file");
+                else
+                    stream_error(stream, errno);
+                break;
+            }
+
+            iov.iov_base = record;
+            iov.iov_len = r;
+        }
+        else {
+            sev_queue_iov(&stream->queue, &iov, 1);
+        }
+
+        size_t n;
+        int status = sev_tls_write(stream->tls, iov.iov_base, iov.iov_len, &n);
+
+        COUNT(stream, writes, 1);
+
+        if (status == SEV_TLS_WANT_WRITE || status == SEV_TLS_WANT_READ) {
+            COUNT(stream, write_eagain, 1);
+            break;
+        }
+
+        if (status != SEV_TLS_OK) {
+            tls_error(stream, status);
+            break;
+        }
+
+        COUNT(stream, bytes_out, n);
+        stream->last_write = ev_now(stream->loop->ev);
+
+        if (chunk->fd == -1) {
+            sev_queue_consume(&stream->queue, pool, n);
+            continue;
+        }
+
+        chunk->start += n;
+
+        if (chunk->start == chunk->end && stream_file_sent(stream) == -1)
+            break;
+    }
+
+    if (record)
+        sev_buffer_put(pool, record, TLS_RECORD_SIZE);
+
+    if (!stream->closed)
+        stream_wrote(stream);
+}
+
+#endif
+
+// timeouts
+
+static uint64_t ticks(ev_tstamp time)
+{
+    return (uint64_t)(time / WHEEL_TICK);
+}
+
+// earliest deadline of the stream, 0 if it has none
+static ev_tstamp stream_deadline(struct sev_stream *stream,
+    const char **reason)
+{
+    ev_tstamp deadline = 0;
+
+    if (stream->connector) {
+        if (stream->connect_timeout > 0) {
+            *reason = SEV_CONNECT_TIMEOUT;
+            deadline = stream->connector->started + stream->connect_timeout;
+        }
+
+        return deadline;
+    }
+
+    if (stream->idle_timeout > 0) {
+        *reason = SEV_IDLE_TIMEOUT;
+        deadline = MAX(stream->last_read, stream->last_write) +
+            stream->idle_timeout;
+    }
+
+    if (stream->read_timeout > 0 && stream->reading) {
+        ev_tstamp read_deadline = stream->last_read + stream->read_timeout;
+
+        if (!deadline || read_deadline < deadline) {
+            *reason = SEV_READ_TIMEOUT;
+            deadline = read_deadline;
+        }
+    }
+
+    if (stream->write_timeout > 0 && stream->queue.head) {
+        ev_tstamp write_deadline = stream->last_write + stream->write_timeout;
+
+        if (!deadline || write_deadline < deadline) {
+            *reason = SEV_WRITE_TIMEOUT;
+            deadline = write_deadline;
+        }
+    }
+
+    return deadline;
+}
+
+static void stream_check(struct sev_stream *stream, uint64_t tick)
+{
+    struct sev_loop *loop = stream->loop;
+
+    sev_wheel_add(&loop->wheel, &stream->timer, tick);
+
+    if (!ev_is_active(&loop->w_wheel))
+        ev_timer_again(loop->ev, &loop->w_wheel);
+}
+
+static void stream_schedule(struct sev_stream *stream)
+{
+    const char *reason;
+    ev_tstamp deadline = stream_deadline(stream, &reason);
+
+    if (deadline == 0) {
+        sev_wheel_remove(&stream->loop->wheel, &stream->timer);
+        return;
+    }
+
+    // round up, never expire early
+    stream_check(stream, ticks(deadline) + 1);
+}
+
+static void timer_expired(struct sev_timer *timer, void *data)
+{
+    struct sev_stream *stream = (struct sev_stream *)
+        ((char *)timer - offsetof(struct sev_stream, timer));
+
+    const char *reason;
+    ev_tstamp deadline = stream_deadline(stream, &reason);
+
+    if (deadline == 0)
+        return;
+
+    // there was activity since it was scheduled
+    if (deadline > ev_now(stream->loop->ev)) {
+        stream_check(stream, ticks(deadline) + 1);
+        return;
+    }
+
+    if (stream->connector)
+        connector_fail(stream->connector, SEV_CLOSE_TIMEOUT, reason);
+    else
+        stream_close(stream, SEV_CLOSE_TIMEOUT, reason);
+}
+
+static void wheel_cb(EV_P_ struct ev_timer *watcher, int revents)
+{
+    struct sev_loop *sloop = watcher->data;
+
+    sev_wheel_advance(&sloop->wheel, ticks(ev_now(EV_A)), timer_expired,
+        sloop);
+
+    if (sloop->wheel.count == 0)
+        ev_timer_stop(EV_A_ watcher);
+}
+
+// interface
+
+// corking
+
+static void stream_dirty(struct sev_stream *stream)
+{
+    if (stream->dirty)
+        return;
+
+    // kept around until flush_cb() gets to it
+    stream->dirty = 1;
+    stream->dirty_next = stream->loop->dirty;
+    stream->loop->dirty = stream;
+    stream_hold(stream);
+}
+
+// one vectored write for everything queued
+static void stream_flush(struct sev_stream *stream)
+{
+    if (stream->closed || stream->writing || stream->connector ||
+            tls_handshaking(stream) || !stream->queue.head)
+        return;
+
+#ifdef SEV_URING
+    if (stream->io) {
+        stream_want_write(stream);
+        return;
+    }
+#endif
+
+    stream_write(stream);
+
+    // whatever didn't fit waits for the socket to drain
+    if (!stream->closed && stream->queue.head)
+        stream_want_write(stream);
+}
+
+// one round over the streams that were ready when it started, the ones
+// that still have data to read go to the back
+static void schedule_cb(EV_P_ struct ev_prepare *watcher, int revents)
+{
+    struct sev_loop *sloop = watcher->data;
+    struct sev_stream *last = sloop->ready_tail;
+    size_t spent = 0;
+    int done = 0;
+
+    while (sloop->ready && !done && spent < sloop->read_budget) {
+        struct sev_stream *stream = sloop->ready;
+
+        sloop->ready = stream->ready_next;
+        if (!sloop->ready)
+            sloop->ready_tail = NULL;
+
+        stream->ready = 0;
+        done = stream == last;
+
+        if (!stream->closed && stream->reading && !stream->throttled) {
+            int weight = stream->weight > 0 ? stream->weight : 1;
+            uint64_t bytes_in = stream->stats.bytes_in;
+
+            int more = stream_read(stream, stream->read_budget * weight,
+                stream->read_calls * weight);
+
+            spent += stream->stats.bytes_in - bytes_in;
+
+            if (!stream->closed && stream->reading && !stream->throttled) {
+                if (more)
+                    stream_ready(stream);
+                else
+                    stream_resume_read(stream);
+            }
+        }
+
+        stream_release(stream);
+    }
+
+    if (!sloop->ready)
+        ev_idle_stop(EV_A_ &sloop->w_ready);
+}
+
+static void ready_cb(EV_P_ struct ev_idle *watcher, int revents)
+{
+}
+
+// lets the streams with tokens again go back to reading
+static void throttle_cb(EV_P_ struct ev_timer *watcher, int revents)
+{
+    struct sev_loop *sloop = watcher->data;
+    struct sev_stream **link = &sloop->throttled;
+
+    while (*link) {
+        struct sev_stream *stream = *link;
+
+        if (!stream->closed && stream_limited(stream)) {
+            link = &stream->throttled_next;
+            continue;
+        }
+
+        *link = stream->throttled_next;
+        stream->throttled = 0;
+
+        if (stream->reading && !stream->closed)
+            stream_resume_read(stream);
+
+        stream_release(stream);
+    }
+
+    if (!sloop->throttled)
+        ev_timer_stop(EV_A_ watcher);
+}
+
+static void flush_cb(EV_P_ struct ev_prepare *watcher, int revents)
+{
+    struct sev_loop *sloop = watcher->data;
+
+    // streams dirtied by callbacks along the way are flushed too
+    while (sloop->dirty) {
+        struct sev_stream *stream = sloop->dirty;
+
+        sloop->dirty = stream->dirty_next;
+        stream->dirty = 0;
+
+        stream_flush(stream);
+        stream_release(stream);
+    }
+}
+
+int sev_stream_timestamps(struct sev_stream *stream, int sample)
+{
+    int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+
+    // the samples are told apart by their ack, which only TCP has
+    if (sample > 0 && !stream->packets && stream->remote_port)
+        flags |= SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+    else
+        sample = 0;
+
+    if (setsockopt(stream->sd, SOL_SOCKET, SO_TIMESTAMPING, &flags,
+            sizeof(flags)) == -1)
+        return -1;
+
+    stream->timestamps = 1;
+    stream->tx_sample = sample;
+
+    return 0;
+}
+
+int sev_server_timestamps(struct sev_server *server, int sample)
+{
+    if (!server->timing) {
+        server->timing = calloc(1, sizeof(struct sev_timing));
+        if (!server->timing)
+            return -1;
+    }
+
+    server->timestamps = 1;
+    server->tx_sample = sample;
+
+    return 0;
+}
+
+struct sev_buf *sev_recv_buf(struct sev_stream *stream, const char *data)
+{
+    struct sev_buf *buf = stream->recv_buf;
+
+    if (stream->recv_mode != SEV_RECV_BUF || !buf || data < buf->data ||
+            data >= buf->data + stream->recv_buffer_size)
+        return NULL;
+
+    return sev_buf_retain(buf);
+}
+
+int sev_flush(struct sev_stream *stream)
+{
+    if (stream->closed)
+        return -1;
+
+    stream_hold(stream);
+    stream_flush(stream);
+
+    return stream_release(stream);
+}
+
+int sev_send(struct sev_stream *stream, const char *data, size_t len)
+{
+    struct iovec iov = { (void *)data, len };
+
+    return sev_sendv(stream, &iov, 1);
+}
+
+// only behind an empty queue; with io_uring, corked or TLS in user space,
+// sends are batched once per loop iteration
+static inline int stream_direct(struct sev_stream *stream)
+{
+    return !stream->writing && !stream->queue.head && !stream->connector &&
+        !stream->io && !stream->corked && !tls_handshaking(stream) &&
+        !tls_user_send(stream);
+}
+
+// tries sending straight away, returns the number of bytes sent or -1 if
+// the stream was closed
+static ssize_t stream_send_now(struct sev_stream *stream,
+    const struct iovec *iov, int iovcnt, size_t len)
+{
+    if (!stream_direct(stream))
+        return 0;
+
+    char control[CMSG_SPACE(sizeof(uint32_t))];
+    struct msghdr msg = {};
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = MIN(iovcnt, IOV_MAX);
+    stream_stamp(stream, &msg, control);
+
+    ssize_t n = sendmsg(stream->sd, &msg, 0);
+
+    COUNT(stream, writes, 1);
+
+    if (n == -1) {
+        if (errno != EAGAIN) {
+            stream_error(stream, errno);
+            return -1;
+        }
+
+        COUNT(stream, write_eagain, 1);
+        return 0;
+    }
+
+    if (n > 0) {
+        COUNT(stream, bytes_out, n);
+        stream->last_write = ev_now(stream->loop->ev);
+        stream_stamped(stream, &msg);
+    }
+
+    // sent part of the data
+    if (n < len)
+        COUNT(stream, partial_writes, 1);
+
+    return n;
+}
+
+// after data was added to the send queue
+static void stream_queued(struct sev_stream *stream)
+{
+    if (stream->queue.len > stream->stats.queued_max) {
+        stream->stats.queued_max = stream->queue.len;
+
+        if (stream->server && stream->queue.len > stream->server->stats.queued_max)
+            stream->server->stats.queued_max = stream->queue.len;
+
+        if (stream->queue.len > stream->loop->stats.queued_max)
+            stream->loop->stats.queued_max = stream->queue.len;
+    }
+
+    // tell libev we want to write, or wait for the end of the iteration;
+    // user space TLS seals everything queued until then in one go
+    if ((stream->corked || tls_user_send(stream)) && !stream->writing &&
+            !stream->connector)
+        stream_dirty(stream);
+    else
+        stream_want_write(stream);
+
+    // ask the application to back off
+    if (!stream->paused && stream->queue.len > stream->high_watermark) {
+        stream->paused = 1;
+
+        if (stream->pause_cb)
+            stream->pause_cb(stream);
+    }
+}
+
+static int stream_queue_packet(struct sev_stream *stream,
+    const struct iovec *iov, int iovcnt, size_t len)
+{
+    struct sev_buf *buf = sev_buf_new(NULL, len);
+    size_t offset = 0;
+    int i;
+
+    if (!buf) {
+        stream_error(stream, ENOMEM);
+        return -1;
+    }
+
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(buf->data + offset, iov[i].iov_base, iov[i].iov_len);
+        offset += iov[i].iov_len;
+    }
+
+    int rv = sev_queue_append_buf(&stream->queue, &stream->loop->buffers, buf,
+        0);
+    sev_buf_release(buf);
+
+    if (rv) {
+        stream_error(stream, ENOMEM);
+        return -1;
+    }
+
+    stream_queued(stream);
+
+    return 0;
+}
+
+int sev_sendv(struct sev_stream *stream, const struct iovec *iov, int iovcnt)
+{
+    size_t len = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+
+    if (stream->closed)
+        return -1;
+
+    stream_sample(stream);
+
+    ssize_t skip = stream_send_now(stream, iov, iovcnt, len);
+    if (skip == -1)
+        return -1;
+
+    // sent all the data, nothing else to do here
+    if (skip == len)
+        return 0;
+
+    len -= skip;
+
+    // buffer full
+    if (stream->queue.len + len > stream->send_limit) {
+        stream_close(stream, SEV_CLOSE_SEND_FULL, "Send buffer full");
+        return -1;
+    }
+
+    // a message is queued whole as a chunk of its own
+    if (stream->packets)
+        return stream_queue_packet(stream, iov, iovcnt, len);
+
+    // queue whatever wasn't sent for later
+    for (i = 0; i < iovcnt; i++) {
+        size_t part = iov[i].iov_len;
+
+        if (skip >= part) {
+            skip -= part;
+            continue;
+        }
+
+        if (sev_queue_append(&stream->queue, &stream->loop->buffers,
+                (char *)iov[i].iov_base + skip, part - skip)) {
+            stream_error(stream, ENOMEM);
+            return -1;
+        }
+
+        skip = 0;
+    }
+
+    stream_queued(stream);
+
+    return 0;
+}
+
+int sev_send_buf(struct sev_stream *stream, struct sev_buf *buf)
+{
+    if (stream->closed)
+        return -1;
+
+    stream_sample(stream);
+
+    struct iovec iov = {buf->data, buf->len};
+    ssize_t skip;
+
+    if (stream_direct(stream) && zerocopy_wanted(stream, buf->len))
+        skip = stream_send_zerocopy(stream, buf, 0);
+    else
+        skip = stream_send_now(stream, &iov, 1, buf->len);
+
+    if (skip == -1)
+        return -1;
+
+    if (skip == buf->len)
+        return 0;
+
+    if (stream->queue.len + buf->len - skip > stream->send_limit) {
+        stream_close(stream, SEV_CLOSE_SEND_FULL, "Send buffer full");
+        return -1;
+    }
+
+    // the rest stays in buf, only a reference is queued
+    if (sev_queue_append_buf(&stream->queue, &stream->loop->buffers, buf,
+            skip)) {
+        stream_error(stream, ENOMEM);
+        return -1;
+    }
+
+    stream_queued(stream);
+
+    return 0;
+}
+
+int sev_broadcast(struct sev_stream **streams, size_t n, struct sev_buf *buf)
+{
+    int sent = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        if (sev_send_buf(streams[i], buf) == 0)
+            sent++;
+    }
+
+    return sent;
+}
+
+int sev_sendfile(struct sev_stream *stream, int fd, off_t offset, size_t len)
+{
+    // there is no way to tell where the messages would end
+    if (stream->closed || stream->packets)
+        return -1;
+
+    if (len == 0) {
+        struct stat st;
+        if (fstat(fd, &st) == -1 || st.st_size < offset)
+            return -1;
+
+        len = st.st_size - offset;
+    }
+
+    if (sev_queue_append_file(&stream->queue, &stream->loop->buffers, fd,
+            offset, len)) {
+        stream_error(stream, ENOMEM);
+        return -1;
+    }
+
+    // the range is sent from stream_write() in order with the rest, corked
+    // and user space TLS streams wait for the end of the iteration
+    stream_queued(stream);
+
+    return 0;
+}
+
+static void stream_close(struct sev_stream *stream, enum sev_close_code code,
+    const char *reason)
+{
+    if (stream->closed)
+        return;
+
+    stream->closed = 1;
+    stream->close_code = code;
+    COUNT(stream, closes[code], 1);
+    stream_hold(stream);
+
+    if (stream->connector)
+        connector_free(stream->connector);
+
+    sev_wheel_remove(&stream->loop->wheel, &stream->timer);
+
+    if (stream->close_cb) {
+        uint64_t start = callback_start(stream->loop);
+        stream->close_cb(stream, reason);
+        callback_end(stream->loop, start);
+    }
+
+    // stop libev watchers, the TLS handshake runs them without the flags
+    ev_io_stop(stream->loop->ev, &stream->w_read);
+    ev_io_stop(stream->loop->ev, &stream->w_write);
+
+    stream->reading = 0;
+    stream->writing = 0;
+
+#ifdef SEV_TLS
+    if (stream->tls)
+        sev_tls_shutdown(stream->tls);
+#endif
+
+    // the kernel may still be reading zero copy buffers
+    if (stream->sd != -1 && stream->zerocopy_pending)
+        zerocopy_linger(stream);
+    else if (stream->sd != -1)
+        close(stream->sd);
+
+#ifdef SEV_URING
+    // the kernel may still be reading the queue, see uring_sent()
+    if (stream->io) {
+        uring_cancel(stream, OP_RECV);
+        uring_cancel(stream, OP_SEND);
+
+        if (stream->io->sending) {
+            stream_release(stream);
+            return;
+        }
+    }
+#endif
+
+    stream_drop_queue(stream);
+    stream_release(stream);
+}
+
+void sev_close(struct sev_stream *stream, const char *reason)
+{
+    stream_close(stream, SEV_CLOSE_LOCAL, reason);
+}
+
+static int listen_socket(const char *address, int port, int reuseport,
+    struct sev_sockopts *opts)
+{
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+
+    if (inet_pton(AF_INET, address, &addr.sin_addr) != 1)
+        return -1;
+
+    // create server socket, non-blocking so accept_cb can drain the backlog
+    int sd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sd == -1)
+        return -1;
+
+    // set reuseaddr
+    int flag = 1;
+    setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+
+    // accepted sockets inherit the options, nodelay included
+    opts->applied = 0;
+    opts->failed = 0;
+    sockopts_apply(opts, sd, 1);
+
+    // let the kernel spread incoming connections over the shards
+    if (reuseport &&
+            setsockopt(sd, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof(flag))) {
+        close(sd);
+        return -1;
+    }
+
+    // bind/listen
+    if (bind(sd, (struct sockaddr*)&addr, sizeof(addr)) == -1 ||
+            listen(sd, opts->backlog ? opts->backlog : SOMAXCONN) == -1) {
+        close(sd);
+        return -1;
+    }
+
+    if (opts->backlog)
+        opts->applied |= SEV_OPT_BACKLOG;
+
+    return sd;
+}
+
+static int unix_listen_socket(const char *path, int type)
+{
+    struct sockaddr_un addr;
+    socklen_t len = unix_address(&addr, path);
+
+    if (!len) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    int sd = socket(AF_UNIX, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sd == -1)
+        return -1;
+
+    // a socket file left behind by a previous run would make bind() fail
+    if (path[0] != '@')
+        unlink(path);
+
+    if (bind(sd, (struct sockaddr *)&addr, len) == -1 ||
+            listen(sd, SOMAXCONN) == -1) {
+        close(sd);
+        return -1;
+    }
+
+    return sd;
+}
+
+static void server_start(struct sev_loop *loop, struct sev_server *server,
+    int sd)
+{
+    server->sd = sd;
+    server->loop = loop;
+    sev_pool_init(&server->streams, sizeof(struct sev_stream),
+        STREAM_POOL_CAPACITY);
+
+    // register with libev
+    ev_io_init(&server->watcher, accept_cb, sd, EV_READ);
+    server->watcher.data = server;
+    ev_init(&server->w_accept, accept_resume_cb);
+    server->w_accept.data = server;
+
+#ifdef SEV_URING
+    if (loop->engine) {
+        uring_accept(server);
+        return;
+    }
+#endif
+
+    ev_io_start(loop->ev, &server->watcher);
+}
+
+int sev_listen(struct sev_loop *loop, struct sev_server *server,
+    const char *address, int port)
+{
+    return sev_listen_opts(loop, server, address, port, NULL);
+}
+
+int sev_listen_opts(struct sev_loop *loop, struct sev_server *server,
+    const char *address, int port, const struct sev_sockopts *opts)
+{
+    if (!loop)
+        loop = sev_loop_default();
+
+    struct sev_sockopts sockopts = {};
+    if (opts)
+        sockopts = *opts;
+
+    int sd = listen_socket(address, port, 0, &sockopts);
+    if (sd == -1)
+        return -1;
+
+    // initialize sev_server structure
+    memset(server, 0, sizeof(struct sev_server));
+    server->sockopts = sockopts;
+    server_start(loop, server, sd);
+
+    return 0;
+}
+
+int sev_listen_unix(struct sev_loop *loop, struct sev_server *server,
+    const char *path, int type)
+{
+    if (!loop)
+        loop = sev_loop_default();
+
+    int sd = unix_listen_socket(path, type);
+    if (sd == -1)
+        return -1;
+
+    memset(server, 0, sizeof(struct sev_server));
+    server->packets = type == SOCK_SEQPACKET;
+    server_start(loop, server, sd);
+
+    return 0;
+}
+
+int sev_server_pool(struct sev_server *server, size_t capacity,
+    size_t prewarm)
+{
+    server->streams.capacity = capacity;
+
+    return sev_pool_prewarm(&server->streams, prewarm);
+}
+
+struct sev_shards *sev_listen_sharded(const struct sev_server *proto,
+    const char *address, int port, int count)
+{
+    if (count <= 0)
+        count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (count <= 0)
+        count = 1;
+
+    struct sev_shards *shards = calloc(1, sizeof(struct sev_shards));
+    if (!shards)
+        return NULL;
+
+    shards->servers = calloc(count, sizeof(struct sev_server));
+    if (!shards->servers) {
+        free(shards);
+        return NULL;
+    }
+
+    for (; shards->count < count; shards->count++) {
+        struct sev_server *server = &shards->servers[shards->count];
+
+        *server = *proto;
+
+        // each shard keeps its own breakdown and streams
+        server->timing = NULL;
+        server->live = NULL;
+        if (proto->timestamps &&
+                sev_server_timestamps(server, proto->tx_sample) == -1)
+            goto fail;
+
+        int sd = listen_socket(address, port, 1, &server->sockopts);
+        if (sd == -1)
+            goto fail;
+
+        struct sev_loop *loop = sev_loop_new();
+        if (!loop) {
+            close(sd);
+            goto fail;
+        }
+
+        server_start(loop, server, sd);
+    }
+
+    return shards;
+
+fail:
+    // the failed shard isn't counted, the ones before it are
+    free(shards->servers[shards->count].timing);
+    sev_shards_free(shards);
+
+    return NULL;
+}
+
+int sev_shards_run(struct sev_shards *shards)
+{
+    int i, rv = 0;
+
+    for (i = 0; i < shards->count; i++) {
+        if (sev_loop_spawn(shards->servers[i].loop, i) == -1) {
+            rv = -1;
+            break;
+        }
+    }
+
+    // stop the shards that did start if one of them failed
+    int started = i;
+    if (rv == -1) {
+        for (i = 0; i < started; i++)
+            sev_loop_stop(shards->servers[i].loop);
+    }
+
+    for (i = 0; i < started; i++)
+        sev_loop_join(shards->servers[i].loop);
+
+    return rv;
+}
+
+void sev_shards_free(struct sev_shards *shards)
+{
+    int i;
+
+    for (i = 0; i < shards->count; i++) {
+        struct sev_server *server = &shards->servers[i];
+
+        ev_io_stop(server->loop->ev, &server->watcher);
+        ev_timer_stop(server->loop->ev, &server->w_accept);
+        close(server->sd);
+
+        // the next one is held, close_cb may close or free others
+        struct sev_stream *stream = server->live;
+        if (stream)
+            stream_hold(stream);
+        while (stream) {
+            struct sev_stream *next = stream->live_next;
+            if (next)
+                stream_hold(next);
+            stream_close(stream, SEV_CLOSE_LOCAL, "Server freed");
+            stream_release(stream);
+            stream = next;
+        }
+
+        // the loop lets go of the streams it still holds before the pool
+        // goes away
+        sev_loop_free(server->loop);
+        sev_pool_clear(&server->streams);
+        free(server->timing);
+    }
+
+    free(shards->servers);
+    free(shards);
+}
+
+static struct sev_stream *connector_new(struct sev_loop *loop, int port,
+    int type)
+{
+    struct sev_stream *stream = stream_alloc(loop, &loop->streams);
+    if (!stream)
+        return NULL;
+
+    struct sev_connector *connector = calloc(1, sizeof(struct sev_connector));
+    if (!connector) {
+        sev_pool_put(stream);
+        return NULL;
+    }
+
+    stream->reading = 1;
+    stream->connector = connector;
+    stream->packets = type == SOCK_SEQPACKET;
+
+    connector->stream = stream;
+    connector->port = port;
+    connector->type = type;
+    connector->started = ev_now(loop->ev);
+
+    ev_init(&connector->w_delay, delay_cb);
+    connector->w_delay.data = connector;
+
+    // first check on the next tick, once the caller had a chance to set
+    // stream->connect_timeout
+    stream_check(stream, loop->wheel.now + 1);
+
+    return stream;
+}
+
+struct sev_stream *sev_connect(struct sev_loop *loop, const char *address,
+    int port)
+{
+    return sev_connect_opts(loop, address, port, NULL);
+}
+
+struct sev_stream *sev_connect_opts(struct sev_loop *loop,
+    const char *address, int port, struct sev_sockopts *opts)
+{
+    if (!loop)
+        loop = sev_loop_default();
+
+    struct sev_stream *stream = connector_new(loop, port, SOCK_STREAM);
+    if (!stream)
+        return NULL;
+
+    struct sev_connector *connector = stream->connector;
+    connector->opts = opts;
+
+    if (opts) {
+        opts->applied = 0;
+        opts->failed = 0;
+    }
+
+    // numeric and cached names are answered right away and may already
+    // have failed, freeing the connector
+    stream_hold(stream);
+    struct sev_resolve *req = sev_resolve(loop, address, resolve_cb,
+        connector);
+
+    if (req && stream->connector == connector)
+        connector->req = req;
+
+    if (stream_release(stream))
+        return NULL;
+
+    return stream;
+}
+
+struct sev_stream *sev_connect_unix(struct sev_loop *loop, const char *path,
+    int type)
+{
+    if (!loop)
+        loop = sev_loop_default();
+
+    struct sev_stream *stream = connector_new(loop, 0, type);
+    if (!stream)
+        return NULL;
+
+    struct sev_connector *connector = stream->connector;
+
+    // a single address, nothing to look up
+    connector->addrs.lens[0] = unix_address(
+        (struct sockaddr_un *)&connector->addrs.addrs[0], path);
+    connector->addrs.count = connector->addrs.lens[0] ? 1 : 0;
+    connector->error = ENAMETOOLONG;
+
+    stream_hold(stream);
+    connector_next(connector);
+
+    if (stream_release(stream))
+        return NULL;
+
+    return stream;
+}
+
+// cross-thread messages
+
+enum sev_message_op {
+    MESSAGE_SEND,
+    MESSAGE_SEND_BUF,
+    MESSAGE_CLOSE,
+};
+
+struct sev_message {
+    struct sev_message *next;
+    uint64_t id;
+    enum sev_message_op op;
+    struct sev_buf *buf;
+    size_t len;
+    char data[];
+};
+
+struct sev_handle sev_stream_handle(struct sev_stream *stream)
+{
+    struct sev_handle handle = {stream->loop, 0};
+
+    if (!stream->slot)
+        stream->slot = slot_get(stream->loop, stream);
+
+    if (stream->slot) {
+        handle.id = (uint64_t)stream->loop->slots[stream->slot - 1].generation
+            << 32 | stream->slot;
+    }
+
+    return handle;
+}
+
+static struct sev_stream *handle_stream(struct sev_loop *loop, uint64_t id)
+{
+    uint32_t slot = (uint32_t)id;
+
+    if (slot == 0 || slot > loop->slot_count)
+        return NULL;
+
+    struct sev_slot *entry = &loop->slots[slot - 1];
+
+    if (entry->generation != id >> 32)
+        return NULL;
+
+    return entry->stream;
+}
+
+// lock-free push, the loop is only woken up when the inbox was empty
+static int message_post(struct sev_handle handle, struct sev_message *message)
+{
+    struct sev_loop *loop = handle.loop;
+    struct sev_message *head = __atomic_load_n(&loop->inbox, __ATOMIC_RELAXED);
+
+    message->id = handle.id;
+
+    do {
+        message->next = head;
+    } while (!__atomic_compare_exchange_n(&loop->inbox, &head, message, 1,
+        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    if (!head)
+        ev_async_send(loop->ev, &loop->w_wakeup);
+
+    return 0;
+}
+
+static struct sev_message *message_new(enum sev_message_op op,
+    const char *data, size_t len)
+{
+    struct sev_message *message = malloc(sizeof(struct sev_message) + len);
+    if (!message)
+        return NULL;
+
+    message->op = op;
+    message->buf = NULL;
+    message->len = len;
+
+    if (len)
+        memcpy(message->data, data, len);
+
+    return message;
+}
+
+int sev_send_async(struct sev_handle handle, const char *data, size_t len)
+{
+    struct sev_message *message = message_new(MESSAGE_SEND, data, len);
+    if (!message)
+        return -1;
+
+    return message_post(handle, message);
+}
+
+int sev_send_buf_async(struct sev_handle handle, struct sev_buf *buf)
+{
+    struct sev_message *message = message_new(MESSAGE_SEND_BUF, NULL, 0);
+    if (!message)
+        return -1;
+
+    message->buf = sev_buf_retain(buf);
+
+    return message_post(handle, message);
+}
+
+int sev_close_async(struct sev_handle handle, const char *reason)
+{
+    if (!reason)
+        reason = "Closed";
+
+    struct sev_message *message = message_new(MESSAGE_CLOSE, reason,
+        strlen(reason) + 1);
+    if (!message)
+        return -1;
+
+    return message_post(handle, message);
+}
+
+static void message_free(struct sev_message *message)
+{
+    if (message->buf)
+        sev_buf_release(message->buf);
+
+    free(message);
+}
+
+static void message_run(struct sev_loop *loop, struct sev_message *message)
+{
+    struct sev_stream *stream = handle_stream(loop, message->id);
+
+    if (!stream || stream->closed)
+        return;
+
+    switch (message->op) {
+    case MESSAGE_SEND:
+        sev_send(stream, message->data, message->len);
+        break;
+
+    case MESSAGE_SEND_BUF:
+        sev_send_buf(stream, message->buf);
+        break;
+
+    case MESSAGE_CLOSE:
+        stream_close(stream, SEV_CLOSE_LOCAL, message->data);
+        break;
+    }
+}
+
+// takes the whole inbox at once and runs it oldest first
+static void inbox_dispatch(struct sev_loop *loop, int run)
+{
+    struct sev_message *message = __atomic_exchange_n(&loop->inbox, NULL,
+        __ATOMIC_ACQUIRE);
+    struct sev_message *ordered = NULL;
+
+    while (message) {
+        struct sev_message *next = message->next;
+        message->next = ordered;
+        ordered = message;
+        message = next;
+    }
+
+    while (ordered) {
+        message = ordered;
+        ordered = message->next;
+
+        if (run)
+            message_run(loop, message);
+
+        message_free(message);
+    }
+}
+
+static void wakeup_cb(EV_P_ struct ev_async *watcher, int revents)
+{
+    struct sev_loop *sloop = watcher->data;
+
+    inbox_dispatch(sloop, 1);
+    sev_resolve_dispatch(sloop);
+
+    if (__atomic_exchange_n(&sloop->stopping, 0, __ATOMIC_ACQ_REL))
+        ev_break(EV_A_ EVBREAK_ALL);
+}
+
+static void sev_loop_init(struct sev_loop *loop, struct ev_loop *ev)
+{
+    loop->ev = ev;
+    loop->cpu = -1;
+    pthread_mutex_init(&loop->lock, NULL);
+    sev_pool_init(&loop->streams, sizeof(struct sev_stream),
+        STREAM_POOL_CAPACITY);
+
+    sev_wheel_init(&loop->wheel, ticks(ev_now(ev)));
+    ev_init(&loop->w_wheel, wheel_cb);
+    loop->w_wheel.repeat = WHEEL_TICK;
+    loop->w_wheel.data = loop;
+
+    // the async watcher must not keep the loop alive on its own
+    ev_async_init(&loop->w_wakeup, wakeup_cb);
+    loop->w_wakeup.data = loop;
+    ev_async_start(ev, &loop->w_wakeup);
+    ev_unref(ev);
+
+    // before the io_uring submission, which has the lowest priority
+    ev_prepare_init(&loop->w_flush, flush_cb);
+    loop->w_flush.data = loop;
+    ev_prepare_start(ev, &loop->w_flush);
+    ev_unref(ev);
+
+    // reads go ahead of the flush, so what they send goes out with it
+    ev_prepare_init(&loop->w_schedule, schedule_cb);
+    ev_set_priority(&loop->w_schedule, 1);
+    loop->w_schedule.data = loop;
+    ev_idle_init(&loop->w_ready, ready_cb);
+
+    ev_init(&loop->w_throttle, throttle_cb);
+    loop->w_throttle.repeat = THROTTLE_TICK;
+    loop->w_throttle.data = loop;
+
+    ev_init(&loop->w_linger, linger_cb);
+    loop->w_linger.repeat = WHEEL_TICK;
+    loop->w_linger.data = loop;
+
+#ifdef SEV_URING
+    const char *engine = getenv("SEV_ENGINE");
+    if (engine && !strcmp(engine, "uring"))
+        sev_loop_engine(loop, SEV_ENGINE_URING);
+#endif
+}
+
+// the loop woke up from polling
+static void check_cb(EV_P_ struct ev_check *watcher, int revents)
+{
+    struct sev_latency *latency = watcher->data;
+
+    latency->woke = sev_clock();
+}
+
+// the loop is about to poll again
+static void prepare_cb(EV_P_ struct ev_prepare *watcher, int revents)
+{
+    struct sev_latency *latency = watcher->data;
+
+    if (latency->woke) {
+        sev_histogram_add(&latency->iteration, sev_clock() - latency->woke);
+        latency->woke = 0;
+    }
+}
+
+int sev_loop_histograms(struct sev_loop *loop, int enable)
+{
+    if (!loop)
+        loop = sev_loop_default();
+
+    struct sev_latency *latency = loop->latency;
+
+    if (!enable) {
+        if (latency) {
+            ev_ref(loop->ev);
+            ev_ref(loop->ev);
+            ev_check_stop(loop->ev, &latency->w_check);
+            ev_prepare_stop(loop->ev, &latency->w_prepare);
+            free(latency);
+            loop->latency = NULL;
+        }
+
+        return 0;
+    }
+
+    if (latency)
+        return 0;
+
+    latency = calloc(1, sizeof(struct sev_latency));
+    if (!latency)
+        return -1;
+
+    // first thing after polling and last thing before polling again
+    ev_check_init(&latency->w_check, check_cb);
+    ev_set_priority(&latency->w_check, EV_MAXPRI);
+    latency->w_check.data = latency;
+    ev_check_start(loop->ev, &latency->w_check);
+    ev_unref(loop->ev);
+
+    ev_prepare_init(&latency->w_prepare, prepare_cb);
+    ev_set_priority(&latency->w_prepare, EV_MINPRI);
+    latency->w_prepare.data = latency;
+    ev_prepare_start(loop->ev, &latency->w_prepare);
+    ev_unref(loop->ev);
+
+    loop->latency = latency;
+
+    return 0;
+}
+
+void sev_loop_stats(struct sev_loop *loop, struct sev_stats *stats)
+{
+    if (!loop)
+        loop = sev_loop_default();
+
+    memset(stats, 0, sizeof(struct sev_stats));
+    stats->counters = loop->stats;
+
+    if (loop->latency) {
+        stats->iteration = loop->latency->iteration;
+        stats->callback = loop->latency->callback;
+    }
+}
+
+char *sev_loop_buffer(struct sev_loop *loop, size_t size)
+{
+    if (loop->recv_buffer_size < size) {
+        char *buffer = realloc(loop->recv_buffer, size);
+        if (!buffer)
+            return NULL;
+
+        loop->recv_buffer = buffer;
+        loop->recv_buffer_size = size;
+    }
+
+    return loop->recv_buffer;
+}
+
+struct sev_buf *sev_loop_buf(struct sev_loop *loop, size_t len)
+{
+    if (!loop->recv_bufs && !(loop->recv_bufs = sev_buf_pool_new()))
+        return NULL;
+
+    return sev_buf_pool_get(loop->recv_bufs, len);
+}
+
+static struct sev_loop default_loop;
+static pthread_once_t default_loop_once = PTHREAD_ONCE_INIT;
+
+static void default_loop_init(void)
+{
+    sev_loop_init(&default_loop, EV_DEFAULT);
+}
+
+struct sev_loop *sev_loop_default(void)
+{
+    pthread_once(&default_loop_once, default_loop_init);
+
+    return &default_loop;
+}
+
+struct sev_loop *sev_loop_new(void)
+{
+    struct ev_loop *ev = ev_loop_new(EVFLAG_AUTO);
+    if (!ev)
+        return NULL;
+
+    struct sev_loop *loop = calloc(1, sizeof(struct sev_loop));
+    if (!loop) {
+        ev_loop_destroy(ev);
+        return NULL;
+    }
+
+    sev_loop_init(loop, ev);
+
+    return loop;
+}
+
+void sev_loop_free(struct sev_loop *loop)
+{
+    if (loop == &default_loop)
+        return;
+
+    sev_loop_histograms(loop, 0);
+    sev_loop_engine(loop, SEV_ENGINE_LIBEV);
+
+    sev_resolve_detach(loop);
+
+    ev_ref(loop->ev);
+    ev_async_stop(loop->ev, &loop->w_wakeup);
+    ev_ref(loop->ev);
+    ev_prepare_stop(loop->ev, &loop->w_flush);
+    sev_loop_schedule(loop, 0);
+
+    while (loop->dirty) {
+        struct sev_stream *stream = loop->dirty;
+
+        loop->dirty = stream->dirty_next;
+        stream->dirty = 0;
+        stream_release(stream);
+    }
+
+    while (loop->throttled) {
+        struct sev_stream *stream = loop->throttled;
+
+        loop->throttled = stream->throttled_next;
+        stream->throttled = 0;
+        stream_release(stream);
+    }
+
+    ev_loop_destroy(loop->ev);
+
+    inbox_dispatch(loop, 0);
+    free(loop->slots);
+
+    while (loop->lingering) {
+        struct sev_linger *linger = loop->lingering;
+
+        loop->lingering = linger->next;
+        linger_reap(linger);
+        linger_close(linger);
+    }
+
+    sev_buffer_pool_clear(&loop->buffers);
+    sev_buf_pool_free(loop->recv_bufs);
+    sev_pool_clear(&loop->streams);
+    pthread_mutex_destroy(&loop->lock);
+    free(loop->recv_buffer);
+
+    free(loop);
+}
+
+void sev_loop_run(struct sev_loop *loop)
+{
+    if (!loop)
+        loop = sev_loop_default();
+
+    signal(SIGPIPE, SIG_IGN);
+
+    ev_run(loop->ev, 0);
+}
+
+static void *loop_thread(void *arg)
+{
+    struct sev_loop *loop = arg;
+
+    if (loop->cpu != -1) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(loop->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    sev_loop_run(loop);
+
+    return NULL;
+}
+
+int sev_loop_spawn(struct sev_loop *loop, int cpu)
+{
+    if (!loop)
+        loop = sev_loop_default();
+
+    int ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    loop->cpu = (cpu < 0 || ncpu <= 0) ? -1 : cpu % ncpu;
+
+    if (pthread_create(&loop->thread, NULL, loop_thread, loop)) {
+        loop->cpu = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+int sev_loop_join(struct sev_loop *loop)
+{
+    if (!loop)
+        loop = sev_loop_default();
+
+    return pthread_join(loop->thread, NULL) ? -1 : 0;
+}
+
+void sev_loop_stop(struct sev_loop *loop)
+{
+    if (!loop)
+        loop = sev_loop_default();
+
+    __atomic_store_n(&loop->stopping, 1, __ATOMIC_RELEASE);
+    ev_async_send(loop->ev, &loop->w_wakeup);
+}
+
+void sev_loop(void)
+{
+    sev_loop_run(NULL);
+}
+
+void sev_block_read(struct sev_stream *stream)
+{
+    if (stream->reading) {
+        stream->reading = 0;
+        ev_io_stop(stream->loop->ev, &stream->w_read);
+
+#ifdef SEV_URING
+        if (stream->io && stream->io->recv_armed)
+            uring_cancel(stream, OP_RECV);
+#endif
+    }
+}
+
+void sev_allow_read(struct sev_stream *stream)
+{
+    if (!stream->reading && !stream->closed) {
+        stream->reading = 1;
+
+        // the read timeout counts from here
+        stream->last_read = ev_now(stream->loop->ev);
+        stream_touch(stream);
+
+#ifdef SEV_URING
+        // held data first, then the receive is armed again
+        if (stream->io) {
+            ev_feed_event(stream->loop->ev, &stream->w_read, EV_READ);
+            return;
+        }
+#endif
+
+        stream_resume_read(stream);
+    }
+}
+
+void sev_loop_schedule(struct sev_loop *loop, size_t budget)
+{
+    if (!loop)
+        loop = sev_loop_default();
+
+    // like the flush, it must not keep the loop alive on its own
+    if (budget && !loop->read_budget) {
+        ev_prepare_start(loop->ev, &loop->w_schedule);
+        ev_unref(loop->ev);
+    }
+    else if (!budget && loop->read_budget) {
+        ev_ref(loop->ev);
+        ev_prepare_stop(loop->ev, &loop->w_schedule);
+        ev_idle_stop(loop->ev, &loop->w_ready);
+
+        // back to reading on readiness
+        while (loop->ready) {
+            struct sev_stream *stream = loop->ready;
+
+            loop->ready = stream->ready_next;
+            stream->ready = 0;
+
+            if (stream->reading && !stream->closed)
+                stream_resume_read(stream);
+
+            stream_release(stream);
+        }
+
+        loop->ready_tail = NULL;
+    }
+
+    loop->read_budget = budget;
 }
@@ -27,73 +27,612 @@
 #define SEV_H
 
 #include <stdlib.h>
+#include <pthread.h>
 #include <netinet/in.h>
 #include <ev.h>
+#include "sev_buffer.h"
+#include "sev_frame.h"
+#include "sev_pool.h"
+#include "sev_resolve.h"
+#include "sev_stats.h"
+#include "sev_tls.h"
+#include "sev_uring.h"
+#include "sev_wheel.h"
 
 #define RECV_BUFFER_SIZE 2048 // fits a 1500-byte MTU packet
-#define SEND_BUFFER_SIZE 4096
+#define STREAM_RECV_SIZE (16 * 1024)
+#define STREAM_READ_BUDGET (256 * 1024) // bytes read per wakeup
+#define STREAM_READ_CALLS 16 // recv calls per wakeup
+#define SEND_HIGH_WATERMARK (64 * 1024)
+#define SEND_LOW_WATERMARK 0
+#define SEND_BUFFER_LIMIT (1024 * 1024) // the stream is closed past this
+#define STREAM_POOL_CAPACITY 1024 // free streams kept per loop or server
+#define ACCEPT_BUDGET 64 // connections accepted per wakeup
+#define ACCEPT_BACKOFF 0.1 // seconds accepting pauses when out of descriptors
+#define CONNECT_TIMEOUT 10.0 // seconds
+#define CONNECT_ATTEMPT_DELAY 0.25 // head start of each address, in seconds
+#define WHEEL_TICK 0.1 // resolution of stream timeouts, in seconds
+#define THROTTLE_TICK 0.01 // how often throttled streams get refilled
+#define ZEROCOPY_LINGER 30.0 // seconds a closed socket waits for zero copy
+
+// close reasons of expired streams
+#define SEV_CONNECT_TIMEOUT "Connect timeout"
+#define SEV_IDLE_TIMEOUT "Idle timeout"
+#define SEV_READ_TIMEOUT "Read timeout"
+#define SEV_WRITE_TIMEOUT "Write timeout"
 
 struct sev_stream;
+struct sev_connector;
+struct sev_latency;
+struct sev_engine;
+struct sev_stream_io;
+struct sev_message;
+struct sev_slot;
+struct sev_tls;
+struct ssl_ctx_st;
+struct sev_zerocopy;
+struct sev_linger;
+
+// how a loop moves bytes, see sev_loop_engine()
+enum sev_engine_type {
+    SEV_ENGINE_LIBEV, // readiness through libev, then plain syscalls
+    SEV_ENGINE_URING, // completions through io_uring, needs SEV_URING
+};
+
+// where stream data is received into
+enum sev_recv_mode {
+    // the loop's buffer, overwritten by the next read on any stream
+    SEV_RECV_SHARED,
+
+    // a buffer owned by the stream, overwritten by its own next read
+    SEV_RECV_STREAM,
+
+    // a refcounted buffer read_cb may keep, see sev_recv_buf(); one nobody
+    // kept is reused for the next read, kept ones go back to the loop's
+    // pool once released
+    SEV_RECV_BUF,
+
+    // wherever the stream's alloc_cb says, see sev_alloc_cb
+    SEV_RECV_USER,
+};
+
+// token bucket, refilled at rate per second up to burst (one second's worth
+// if 0); a rate of 0 means no limit
+struct sev_rate {
+    double rate;
+    double burst;
+    double tokens;
+    ev_tstamp last;
+};
+
+// read rate limits, streams that run out stop reading until refilled
+struct sev_limit {
+    struct sev_rate bytes;
+    struct sev_rate messages; // read_cb calls
+};
+
+// bits of sev_sockopts.applied and sev_sockopts.failed
+enum sev_sockopt {
+    SEV_OPT_BACKLOG = 1 << 0,
+    SEV_OPT_RCVBUF = 1 << 1,
+    SEV_OPT_SNDBUF = 1 << 2,
+    SEV_OPT_DEFER_ACCEPT = 1 << 3,
+    SEV_OPT_FASTOPEN = 1 << 4,
+    SEV_OPT_NOTSENT_LOWAT = 1 << 5,
+    SEV_OPT_BUSY_POLL = 1 << 6,
+    SEV_OPT_QUICKACK = 1 << 7,
+    SEV_OPT_INCOMING_CPU = 1 << 8,
+    SEV_OPT_KEEPALIVE = 1 << 9,
+    SEV_OPT_NAGLE = 1 << 10,
+};
+
+// socket tuning for sev_listen_opts() and sev_connect_opts(), fields left at
+// 0 keep the defaults; listener settings are inherited by accepted sockets
+struct sev_sockopts {
+    int backlog; // listeners only, capped by net.core.somaxconn
+    int rcvbuf;
+    int sndbuf;
+    int defer_accept; // seconds, listeners only
+    int fastopen; // queue length for listeners, any value for clients
+    int notsent_lowat;
+    int busy_poll; // microseconds
+    int quickack; // set again on every accepted socket
+    int incoming_cpu; // cpu + 1
+    int keepalive; // idle seconds before the first probe
+    int keepalive_interval;
+    int keepalive_count;
+    int nagle; // keeps nagle's algorithm on, it's off by default
+
+    // what was requested and set, and what the kernel refused
+    unsigned applied;
+    unsigned failed;
+};
+
+struct sev_loop {
+    // libev loop
+    struct ev_loop *ev;
+
+    // wakes the loop up from other threads
+    struct ev_async w_wakeup;
+
+    // set by sev_loop_stop() from any thread, only accessed atomically
+    int stopping;
+
+    // thread running the loop, see sev_loop_spawn()
+    pthread_t thread;
+    int cpu;
+
+    // finished name lookups, handed over by the resolver threads
+    pthread_mutex_t lock;
+    struct sev_resolve *resolved;
+
+    // shared receive buffer, only touched by the loop's own thread
+    char *recv_buffer;
+    size_t recv_buffer_size;
+
+    // free send queue chunks and receive buffers
+    struct sev_buffer_pool buffers;
+
+    // retainable receive buffers, see SEV_RECV_BUF
+    struct sev_buf_pool *recv_bufs;
+
+    // streams created by sev_connect()
+    struct sev_pool streams;
+
+    // stream timeouts, driven by a single libev timer
+    struct sev_wheel wheel;
+    struct ev_timer w_wheel;
+
+    // totals of the loop's streams and sockets
+    struct sev_counters stats;
+
+    // histograms, see sev_loop_histograms()
+    struct sev_latency *latency;
+
+    // io_uring state, NULL with the libev engine
+    struct sev_engine *engine;
+
+    // corked streams with unsent data, written out before the loop blocks
+    struct sev_stream *dirty;
+    struct ev_prepare w_flush;
+
+    // sends and closes from other threads, newest first, see sev_send_async()
+    struct sev_message *inbox;
+
+    // streams that have a handle, see sev_stream_handle()
+    struct sev_slot *slots;
+    uint32_t slot_count;
+    uint32_t slot_free;
+
+    // streams waiting for their turn to read, see sev_loop_schedule()
+    size_t read_budget;
+    struct sev_stream *ready;
+    struct sev_stream *ready_tail;
+    struct ev_prepare w_schedule;
+    struct ev_idle w_ready;
+
+    // streams over their read limits
+    struct sev_stream *throttled;
+    struct ev_timer w_throttle;
+
+    // closed sockets with zero copy sends in flight, see ZEROCOPY_LINGER
+    struct sev_linger *lingering;
+    struct ev_timer w_linger;
+
+    // user data
+    void *data;
+};
 
 typedef void (sev_open_cb)(struct sev_stream *stream);
 typedef void (sev_read_cb)(struct sev_stream *stream, char *data, size_t len);
 typedef void (sev_close_cb)(struct sev_stream *stream, const char *reason);
+typedef void (sev_pause_cb)(struct sev_stream *stream);
+typedef void (sev_drain_cb)(struct sev_stream *stream);
+typedef void (sev_sendfile_cb)(struct sev_stream *stream, int fd, int status);
+typedef void (sev_connect_cb)(struct sev_stream *stream, const char *error);
+
+// SEV_RECV_USER: returns where the next read goes, with *size (recv_size on
+// entry) set to the room there; no null byte is added past the data unless
+// the stream is framed, in which case the last byte of the room is kept
+// for it. NULL or no room blocks reading until sev_allow_read()
+typedef char *(sev_alloc_cb)(struct sev_stream *stream, size_t *size);
 
 struct sev_server {
     // socket descriptor
     int sd;
 
+    struct sev_loop *loop;
+
     // libev watcher
     struct ev_io watcher;
 
+    // restarts accepting after a pause, see ACCEPT_BACKOFF
+    struct ev_timer w_accept;
+
+    // waiting for room in the io_uring submission queue to accept again
+    struct sev_server *accept_next;
+    int accept_waiting;
+
     // callbacks
     sev_open_cb *open_cb;
     sev_read_cb *read_cb;
     sev_close_cb *close_cb;
+    sev_pause_cb *pause_cb;
+    sev_drain_cb *drain_cb;
+    sev_sendfile_cb *sendfile_cb;
+
+    // send queue limits for accepted streams, 0 means the default
+    size_t high_watermark;
+    size_t low_watermark;
+    size_t send_limit;
+
+    // read settings for accepted streams, 0 means the default
+    size_t recv_size;
+    size_t read_budget;
+    int read_calls;
+    enum sev_recv_mode recv_mode;
+    sev_alloc_cb *alloc_cb;
+
+    // read limits of all the accepted streams together, and of each one
+    struct sev_limit limit;
+    struct sev_limit stream_limit;
+
+    // see sev_stream.weight
+    int weight;
+
+    // accepted streams get kernel timestamps, see sev_server_timestamps()
+    int timestamps;
+    int tx_sample;
+    struct sev_timing *timing;
+
+    // connections accepted per wakeup, 0 means the default
+    int accept_budget;
+
+    // accepted streams start corked, see sev_stream.corked
+    int corked;
+
+    // see sev_stream.zerocopy_threshold
+    size_t zerocopy_threshold;
+
+    // a SOCK_SEQPACKET listener, see sev_stream.packets
+    int packets;
+
+    // listener tuning, see sev_listen_opts()
+    struct sev_sockopts sockopts;
+
+    // accepted streams run a TLS handshake first, see sev_tls_server_ctx();
+    // needs SEV_TLS
+    struct ssl_ctx_st *tls;
+
+    // timeouts of accepted streams in seconds, 0 means none
+    double idle_timeout;
+    double read_timeout;
+    double write_timeout;
+
+    // framing of accepted streams, see sev_frame_length() and
+    // sev_frame_delimiter()
+    struct sev_frame frame;
+
+    // accepted streams, see sev_server_pool()
+    struct sev_pool streams;
+    // the ones not freed yet, see sev_shards_free()
+    struct sev_stream *live;
+
+    // totals of the accepted streams
+    struct sev_counters stats;
 
     // user data
     void *data;
 };
 
 struct sev_stream {
+    // the fields used on every read come first and share a cache line
+
     // socket descriptor
     int sd;
 
+    int reading;
+    int writing;
+
+    // callbacks in progress, the stream is freed once they all return
+    int busy;
+    int closed;
+
+    // each wakeup reads up to read_calls times, recv_size bytes at a time,
+    // until the socket is drained or read_budget bytes have been read
+    int read_calls;
+
+    struct sev_loop *loop;
+    sev_read_cb *read_cb;
+    char *recv_buffer;
+    size_t recv_size;
+    size_t read_budget;
+
+    // data waiting for the socket to become writable
+    struct sev_queue queue;
+
     // libev watchers
     struct ev_io w_read;
     struct ev_io w_write;
-    int reading;
-    int writing;
 
     // callbacks
     sev_open_cb *open_cb;
-    sev_read_cb *read_cb;
     sev_close_cb *close_cb;
 
-    // stream info
-    char remote_address[INET_ADDRSTRLEN];
+    // backpressure: pause_cb is called once the send queue grows past
+    // high_watermark, drain_cb once it is back down to low_watermark
+    sev_pause_cb *pause_cb;
+    sev_drain_cb *drain_cb;
+    size_t high_watermark;
+    size_t low_watermark;
+    int paused;
+
+    // called once a sev_sendfile() range is fully sent (status 0) or dropped
+    // because the stream was closed (status -1)
+    sev_sendfile_cb *sendfile_cb;
+
+    // the stream is closed if the send queue would grow past this
+    size_t send_limit;
+
+    // if set, sends are only queued and written with a single syscall at
+    // the end of the loop iteration, or by sev_flush()
+    int corked;
+    int dirty;
+    struct sev_stream *dirty_next;
+
+    // index + 1 in the loop's handle slots, 0 if there is no handle yet
+    uint32_t slot;
+
+    // TLS state, NULL for plain streams
+    struct sev_tls *tls;
+
+    // shared buffers of at least this many bytes go out with MSG_ZEROCOPY
+    // and are held until the kernel is done with them, 0 turns it off; not
+    // used with io_uring, TLS or SOCK_SEQPACKET. A closed stream's socket
+    // stays open for up to ZEROCOPY_LINGER seconds until then, buffers still
+    // held after that are never released
+    size_t zerocopy_threshold;
+    int zerocopy; // 1 once SO_ZEROCOPY is on, -1 if it was refused
+    uint32_t zerocopy_next;
+    struct sev_zerocopy *zerocopy_pending;
+    struct sev_zerocopy *zerocopy_last;
+
+    // SOCK_SEQPACKET: every send goes out as a message of its own, every
+    // read_cb gets one message, cut at recv_size - 1 bytes
+    int packets;
+
+    // outgoing connection in progress, see sev_connect()
+    struct sev_connector *connector;
+    sev_connect_cb *connect_cb;
+
+    // timeouts in seconds, 0 means none; expired streams are closed with
+    // one of the SEV_*_TIMEOUT reasons
+    double connect_timeout;
+    double idle_timeout;  // nothing sent or received
+    double read_timeout;  // nothing received while reading
+    double write_timeout; // no progress on the send queue
+    struct sev_timer timer;
+
+    // last activity, in libev time
+    ev_tstamp last_read;
+    ev_tstamp last_write;
+
+    // recv_mode only applies to the libev engine, io_uring reads land in
+    // the ring's buffers
+    enum sev_recv_mode recv_mode;
+    size_t recv_buffer_size;
+    sev_alloc_cb *alloc_cb;
+
+    // SEV_RECV_BUF: the buffer of the last read, recv_buffer_size bytes
+    struct sev_buf *recv_buf;
+
+    // read limits, also bound by the server's; libev engine only
+    struct sev_limit limit;
+    int throttled;
+    struct sev_stream *throttled_next;
+
+    // with sev_loop_schedule(), each turn reads up to weight times
+    // read_budget bytes (0 counts as 1)
+    int weight;
+    int ready;
+    struct sev_stream *ready_next;
+
+    // kernel receive time of the data handed to read_cb, in ev_time() terms;
+    // 0 unless timestamping, see sev_stream_timestamps()
+    ev_tstamp arrival;
+    int timestamps;
+
+    // every tx_sample-th send is timed until acked, one at a time
+    int tx_sample;
+    int tx_count;
+    int tx_wanted; // the next write asks for timestamps
+    int tx_inflight;
+    ev_tstamp tx_queued;
+
+    // if set, read_cb gets whole messages instead of what recv() returned
+    struct sev_frame frame;
+
+    struct sev_counters stats;
+
+    // set before close_cb is called
+    enum sev_close_code close_code;
+
+    // in flight io_uring operations, NULL with the libev engine
+    struct sev_stream_io *io;
+
+    // stream info; unix sockets have the peer's path (prefixed with '@' in
+    // the abstract namespace, empty if unnamed, cut to fit) and port 0
+    char remote_address[INET6_ADDRSTRLEN];
     int remote_port;
 
     struct sev_server *server;
+    struct sev_stream *live_prev;
+    struct sev_stream *live_next;
 
     // user data
     void *data;
+};
+
+// refers to a stream from any thread, stays safe to use after the stream
+// is freed, in which case whatever is sent through it is dropped
+struct sev_handle {
+    struct sev_loop *loop;
+    uint64_t id;
+};
 
-    // circular buffer
-    char buffer[SEND_BUFFER_SIZE];
-    size_t buffer_start;
-    size_t buffer_end;
-    size_t buffer_len;
+// one listener per loop, all bound to the same address with SO_REUSEPORT
+struct sev_shards {
+    int count;
+    struct sev_server *servers;
 };
 
 int sev_send(struct sev_stream *stream, const char *data, size_t len);
 
+// sends the iov entries in order with a single syscall if possible
+int sev_sendv(struct sev_stream *stream, const struct iovec *iov, int iovcnt);
+
+// queues len bytes of fd starting at offset (up to the end of the file if len
+// is 0) after any pending data; fd must stay open until sendfile_cb is called
+int sev_sendfile(struct sev_stream *stream, int fd, off_t offset, size_t len);
+
+// queues a reference to buf instead of copying it, the caller keeps its own
+// reference and releases it whenever it's done
+int sev_send_buf(struct sev_stream *stream, struct sev_buf *buf);
+
+// sends buf to every stream, returns the number it was queued on
+int sev_broadcast(struct sev_stream **streams, size_t n, struct sev_buf *buf);
+
+// from read_cb in SEV_RECV_BUF mode, returns a reference to the buffer data
+// points into (data - buf->data is its offset), NULL if it doesn't live in
+// one, like frames put together from several reads
+struct sev_buf *sev_recv_buf(struct sev_stream *stream, const char *data);
+
+// SO_TIMESTAMPING with software timestamps: receive times in
+// stream->arrival, and every sample-th send (0 for none, TCP only) timed
+// until it leaves and is acked; both feed the server's timing if it has
+// one. libev engine only, TLS streams get no receive times
+int sev_stream_timestamps(struct sev_stream *stream, int sample);
+
+// writes out what a corked stream has queued right away
+int sev_flush(struct sev_stream *stream);
+
 void sev_close(struct sev_stream *stream, const char *reason);
 
-int sev_listen(struct sev_server *server, const char *address, int port);
+// only on the stream's loop thread
+struct sev_handle sev_stream_handle(struct sev_stream *stream);
+
+// thread-safe versions of sev_send(), sev_send_buf() and sev_close(), carried
+// out in order by the stream's loop; they return -1 only if out of memory
+int sev_send_async(struct sev_handle handle, const char *data, size_t len);
+
+int sev_send_buf_async(struct sev_handle handle, struct sev_buf *buf);
+
+int sev_close_async(struct sev_handle handle, const char *reason);
+
+// a NULL loop means the default loop everywhere below
+
+int sev_listen(struct sev_loop *loop, struct sev_server *server,
+    const char *address, int port);
+
+// sev_listen() with the socket tuned by opts, a copy of which (applied and
+// failed included) ends up in server->sockopts
+int sev_listen_opts(struct sev_loop *loop, struct sev_server *server,
+    const char *address, int port, const struct sev_sockopts *opts);
+
+// listens on a unix socket path, or a name in the abstract namespace if it
+// starts with '@'; type is SOCK_STREAM or SOCK_SEQPACKET, a stale socket
+// file at path is replaced
+int sev_listen_unix(struct sev_loop *loop, struct sev_server *server,
+    const char *path, int type);
+
+// keeps up to capacity free streams around for reuse and preallocates
+// prewarm of them
+int sev_server_pool(struct sev_server *server, size_t capacity,
+    size_t prewarm);
+
+// opens count listeners (one per cpu if count is 0), each on its own loop;
+// callbacks, socket options and user data are copied from proto
+struct sev_shards *sev_listen_sharded(const struct sev_server *proto,
+    const char *address, int port, int count);
+
+// runs every shard on its own thread pinned to a cpu, returns once all the
+// loops have stopped
+int sev_shards_run(struct sev_shards *shards);
+
+// the shards must be stopped; streams still open are closed with
+// SEV_CLOSE_LOCAL, calling close_cb
+void sev_shards_free(struct sev_shards *shards);
+
+// returns right away, the name is looked up on a resolver thread and the
+// addresses are tried happy eyeballs style; connect_cb reports the outcome
+// (error is NULL on success) and a stream that failed to connect is then
+// closed; data sent in the meantime is queued
+struct sev_stream *sev_connect(struct sev_loop *loop, const char *address,
+    int port);
+
+// sev_connect() with every socket it tries tuned by opts, which must stay
+// around until connect_cb and collects the applied and failed bits
+struct sev_stream *sev_connect_opts(struct sev_loop *loop,
+    const char *address, int port, struct sev_sockopts *opts);
+
+// makes a stream returned by sev_connect() run a TLS handshake once
+// connected, connect_cb then reports its outcome; hostname is sent as SNI
+// and checked against the certificate if the context verifies the peer;
+// fails unless built with SEV_TLS
+int sev_tls_connect(struct sev_stream *stream, struct ssl_ctx_st *ctx,
+    const char *hostname);
+
+// like sev_connect() for the paths taken by sev_listen_unix(), returns NULL
+// if the connection already failed
+struct sev_stream *sev_connect_unix(struct sev_loop *loop, const char *path,
+    int type);
+
+struct sev_loop *sev_loop_default(void);
+
+// the loop's shared receive buffer, grown to at least size bytes
+char *sev_loop_buffer(struct sev_loop *loop, size_t size);
+
+// a pooled buffer of len bytes for SEV_RECV_BUF reads
+struct sev_buf *sev_loop_buf(struct sev_loop *loop, size_t len);
+
+struct sev_loop *sev_loop_new(void);
+
+void sev_loop_free(struct sev_loop *loop);
+
+// runs the loop on the calling thread until it has no more work or is stopped
+void sev_loop_run(struct sev_loop *loop);
+
+// starts a thread running the loop, pinned to cpu unless cpu is -1
+int sev_loop_spawn(struct sev_loop *loop, int cpu);
+
+int sev_loop_join(struct sev_loop *loop);
+
+// thread-safe
+void sev_loop_stop(struct sev_loop *loop);
+
+// switches the loop to another engine, only before any server or stream is
+// created on it; new loops also pick SEV_ENGINE_URING if the SEV_ENGINE
+// environment variable is "uring"
+int sev_loop_engine(struct sev_loop *loop, enum sev_engine_type type);
+
+// records loop iteration and callback times, off by default since it reads
+// the clock around every callback
+int sev_loop_histograms(struct sev_loop *loop, int enable);
+
+// copies the loop's counters and histograms; meant for the loop's thread,
+// from other threads the values may be slightly off
+void sev_loop_stats(struct sev_loop *loop, struct sev_stats *stats);
+
+// timestamps accepted streams with sev_stream_timestamps() and collects
+// their latency breakdown in server->timing, see sev_timing_format()
+int sev_server_timestamps(struct sev_server *server, int sample);
 
-struct sev_stream *sev_connect(const char *address, int port);
+// streams read in weighted round-robin turns, taken between iterations up
+// to budget bytes per iteration; 0 goes back to reading on every wakeup.
+// libev engine only
+void sev_loop_schedule(struct sev_loop *loop, size_t budget);
 
+// runs the default loop
 void sev_loop(void);
 
 void sev_block_read(struct sev_stream *stream);
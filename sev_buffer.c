@@ -0,0 +1,474 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <stddef.h>
+#include "sev_buffer.h"
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+
+struct sev_buf *sev_buf_new(const char *data, size_t len)
+{
+    struct sev_buf *buf = malloc(sizeof(struct sev_buf) + len);
+    if (!buf)
+        return NULL;
+
+    buf->refs = 1;
+    buf->len = len;
+    buf->data = (char *)(buf + 1);
+    buf->release_cb = NULL;
+    buf->pool = NULL;
+
+    if (data)
+        memcpy(buf->data, data, len);
+
+    return buf;
+}
+
+struct sev_buf *sev_buf_wrap(char *data, size_t len,
+    sev_buf_release_cb *release_cb, void *release_data)
+{
+    struct sev_buf *buf = malloc(sizeof(struct sev_buf));
+    if (!buf)
+        return NULL;
+
+    buf->refs = 1;
+    buf->len = len;
+    buf->data = data;
+    buf->release_cb = release_cb;
+    buf->release_data = release_data;
+    buf->pool = NULL;
+
+    return buf;
+}
+
+struct sev_buf *sev_buf_retain(struct sev_buf *buf)
+{
+    __atomic_add_fetch(&buf->refs, 1, __ATOMIC_RELAXED);
+
+    return buf;
+}
+
+static void buf_pool_return(struct sev_buf *buf);
+
+void sev_buf_release(struct sev_buf *buf)
+{
+    if (__atomic_sub_fetch(&buf->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    if (buf->pool) {
+        buf_pool_return(buf);
+        return;
+    }
+
+    if (buf->release_cb)
+        buf->release_cb(buf->data, buf->release_data);
+
+    free(buf);
+}
+
+int sev_buf_shared(struct sev_buf *buf)
+{
+    return __atomic_load_n(&buf->refs, __ATOMIC_ACQUIRE) > 1;
+}
+
+static int size_class(size_t size)
+{
+    int class = 0;
+    size_t class_size = POOL_MIN_SIZE;
+
+    while (class_size < size) {
+        class_size <<= 1;
+        class++;
+    }
+
+    return class;
+}
+
+size_t sev_buffer_size(size_t size)
+{
+    int class = size_class(size);
+
+    return class < POOL_CLASSES ? (size_t)POOL_MIN_SIZE << class : size;
+}
+
+void *sev_buffer_get(struct sev_buffer_pool *pool, size_t size)
+{
+    int class = size_class(size);
+
+    if (class >= POOL_CLASSES)
+        return malloc(size);
+
+    void *buffer = pool->free[class];
+
+    if (!buffer)
+        return malloc((size_t)POOL_MIN_SIZE << class);
+
+    // free buffers link through their first bytes
+    pool->free[class] = *(void **)buffer;
+    pool->count[class]--;
+
+    return buffer;
+}
+
+void sev_buffer_put(struct sev_buffer_pool *pool, void *buffer, size_t size)
+{
+    int class = size_class(size);
+
+    if (class >= POOL_CLASSES ||
+            pool->count[class] >= POOL_CLASS_BYTES / (POOL_MIN_SIZE << class)) {
+        free(buffer);
+        return;
+    }
+
+    *(void **)buffer = pool->free[class];
+    pool->free[class] = buffer;
+    pool->count[class]++;
+}
+
+struct sev_buf_pool *sev_buf_pool_new(void)
+{
+    struct sev_buf_pool *pool = calloc(1, sizeof(struct sev_buf_pool));
+    if (!pool)
+        return NULL;
+
+    pool->refs = 1;
+
+    return pool;
+}
+
+// sorts the released buffers back into their classes, called by the owner
+// or once nobody else is left
+static void buf_pool_reclaim(struct sev_buf_pool *pool)
+{
+    struct sev_buf *buf = __atomic_exchange_n(&pool->returned, NULL,
+        __ATOMIC_ACQUIRE);
+
+    while (buf) {
+        struct sev_buf *next = buf->next;
+        int class = size_class(buf->size);
+
+        if (pool->count[class] >= POOL_CLASS_BYTES / buf->size) {
+            free(buf);
+        }
+        else {
+            buf->next = pool->free[class];
+            pool->free[class] = buf;
+            pool->count[class]++;
+        }
+
+        buf = next;
+    }
+}
+
+static void buf_pool_unref(struct sev_buf_pool *pool)
+{
+    if (__atomic_sub_fetch(&pool->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    int class;
+
+    buf_pool_reclaim(pool);
+
+    for (class = 0; class < POOL_CLASSES; class++) {
+        while (pool->free[class]) {
+            struct sev_buf *buf = pool->free[class];
+            pool->free[class] = buf->next;
+            free(buf);
+        }
+    }
+
+    free(pool);
+}
+
+// from any thread, the owner only ever takes the whole list
+static void buf_pool_return(struct sev_buf *buf)
+{
+    struct sev_buf_pool *pool = buf->pool;
+    struct sev_buf *head = __atomic_load_n(&pool->returned, __ATOMIC_RELAXED);
+
+    do {
+        buf->next = head;
+    } while (!__atomic_compare_exchange_n(&pool->returned, &head, buf, 1,
+        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    buf_pool_unref(pool);
+}
+
+void sev_buf_pool_free(struct sev_buf_pool *pool)
+{
+    if (pool)
+        buf_pool_unref(pool);
+}
+
+struct sev_buf *sev_buf_pool_get(struct sev_buf_pool *pool, size_t len)
+{
+    int class = size_class(len);
+
+    if (class >= POOL_CLASSES)
+        return sev_buf_new(NULL, len);
+
+    if (!pool->free[class])
+        buf_pool_reclaim(pool);
+
+    struct sev_buf *buf = pool->free[class];
+
+    if (buf) {
+        pool->free[class] = buf->next;
+        pool->count[class]--;
+    }
+    else {
+        size_t size = (size_t)POOL_MIN_SIZE << class;
+
+        buf = malloc(sizeof(struct sev_buf) + size);
+        if (!buf)
+            return NULL;
+
+        buf->data = (char *)(buf + 1);
+        buf->size = size;
+        buf->release_cb = NULL;
+        buf->pool = pool;
+    }
+
+    buf->refs = 1;
+    buf->len = len;
+
+    // each buffer out keeps the pool
+    __atomic_add_fetch(&pool->refs, 1, __ATOMIC_RELAXED);
+
+    return buf;
+}
+
+void sev_buffer_pool_clear(struct sev_buffer_pool *pool)
+{
+    int class;
+
+    for (class = 0; class < POOL_CLASSES; class++) {
+        while (pool->free[class]) {
+            void *buffer = pool->free[class];
+            pool->free[class] = *(void **)buffer;
+            free(buffer);
+        }
+
+        pool->count[class] = 0;
+    }
+
+    while (pool->refs) {
+        struct sev_chunk *chunk = pool->refs;
+        pool->refs = chunk->next;
+        free(chunk);
+    }
+
+    pool->ref_count = 0;
+}
+
+struct sev_chunk *sev_chunk_get(struct sev_buffer_pool *pool)
+{
+    struct sev_chunk *chunk = sev_buffer_get(pool, SEND_CHUNK_SIZE);
+    if (!chunk)
+        return NULL;
+
+    chunk->next = NULL;
+    chunk->start = 0;
+    chunk->end = 0;
+    chunk->size = SEND_CHUNK_SIZE - offsetof(struct sev_chunk, data);
+    chunk->fd = -1;
+    chunk->buf = NULL;
+
+    return chunk;
+}
+
+void sev_chunk_put(struct sev_buffer_pool *pool, struct sev_chunk *chunk)
+{
+    if (!chunk->buf) {
+        sev_buffer_put(pool, chunk, SEND_CHUNK_SIZE);
+        return;
+    }
+
+    sev_buf_release(chunk->buf);
+
+    // reference chunks are just the header, kept on their own list
+    if (pool->ref_count >= POOL_CLASS_BYTES / sizeof(struct sev_chunk)) {
+        free(chunk);
+        return;
+    }
+
+    chunk->next = pool->refs;
+    pool->refs = chunk;
+    pool->ref_count++;
+}
+
+static inline char *chunk_data(struct sev_chunk *chunk)
+{
+    return chunk->buf ? chunk->buf->data : chunk->data;
+}
+
+static struct sev_chunk *queue_grow(struct sev_queue *queue,
+    struct sev_buffer_pool *pool)
+{
+    struct sev_chunk *chunk = sev_chunk_get(pool);
+    if (!chunk)
+        return NULL;
+
+    if (queue->tail)
+        queue->tail->next = chunk;
+    else
+        queue->head = chunk;
+
+    queue->tail = chunk;
+
+    return chunk;
+}
+
+int sev_queue_append(struct sev_queue *queue, struct sev_buffer_pool *pool,
+    const char *data, size_t len)
+{
+    while (len > 0) {
+        struct sev_chunk *chunk = queue->tail;
+
+        // grow the queue by one chunk
+        if (!chunk || chunk->fd != -1 || chunk->buf ||
+                chunk->end == chunk->size) {
+            chunk = queue_grow(queue, pool);
+            if (!chunk)
+                return -1;
+        }
+
+        size_t n = MIN(chunk->size - chunk->end, len);
+        memcpy(chunk->data + chunk->end, data, n);
+
+        chunk->end += n;
+        queue->len += n;
+        data += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+int sev_queue_append_buf(struct sev_queue *queue,
+    struct sev_buffer_pool *pool, struct sev_buf *buf, size_t offset)
+{
+    struct sev_chunk *chunk = pool->refs;
+
+    if (chunk) {
+        pool->refs = chunk->next;
+        pool->ref_count--;
+    }
+    else {
+        chunk = malloc(sizeof(struct sev_chunk));
+        if (!chunk)
+            return -1;
+    }
+
+    chunk->next = NULL;
+    chunk->start = offset;
+    chunk->end = buf->len;
+    chunk->size = buf->len;
+    chunk->fd = -1;
+    chunk->buf = sev_buf_retain(buf);
+
+    if (queue->tail)
+        queue->tail->next = chunk;
+    else
+        queue->head = chunk;
+
+    queue->tail = chunk;
+    queue->len += buf->len - offset;
+
+    return 0;
+}
+
+int sev_queue_append_file(struct sev_queue *queue,
+    struct sev_buffer_pool *pool, int fd, off_t offset, size_t len)
+{
+    struct sev_chunk *chunk = queue_grow(queue, pool);
+    if (!chunk)
+        return -1;
+
+    chunk->fd = fd;
+    chunk->start = offset;
+    chunk->end = offset + len;
+
+    return 0;
+}
+
+int sev_queue_iov(struct sev_queue *queue, struct iovec *iov, int max)
+{
+    struct sev_chunk *chunk = queue->head;
+    int count = 0;
+
+    for (; chunk && chunk->fd == -1 && count < max; chunk = chunk->next) {
+        iov[count].iov_base = chunk_data(chunk) + chunk->start;
+        iov[count].iov_len = chunk->end - chunk->start;
+        count++;
+    }
+
+    return count;
+}
+
+void sev_queue_consume(struct sev_queue *queue, struct sev_buffer_pool *pool,
+    size_t n)
+{
+    while (n > 0) {
+        struct sev_chunk *chunk = queue->head;
+        size_t available = chunk->end - chunk->start;
+
+        if (n < available) {
+            chunk->start += n;
+            queue->len -= n;
+            return;
+        }
+
+        n -= available;
+        sev_queue_pop(queue, pool);
+    }
+}
+
+void sev_queue_pop(struct sev_queue *queue, struct sev_buffer_pool *pool)
+{
+    struct sev_chunk *chunk = queue->head;
+
+    if (chunk->fd == -1)
+        queue->len -= chunk->end - chunk->start;
+
+    queue->head = chunk->next;
+    if (!queue->head)
+        queue->tail = NULL;
+
+    sev_chunk_put(pool, chunk);
+}
+
+void sev_queue_clear(struct sev_queue *queue, struct sev_buffer_pool *pool)
+{
+    while (queue->head) {
+        struct sev_chunk *chunk = queue->head;
+        queue->head = chunk->next;
+        sev_chunk_put(pool, chunk);
+    }
+
+    queue->tail = NULL;
+    queue->len = 0;
+}
@@ -0,0 +1,173 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SEV_BUFFER_H
+#define SEV_BUFFER_H
+
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define SEND_CHUNK_SIZE 4096 // including the chunk header
+#define POOL_MIN_SIZE 1024
+#define POOL_CLASSES 7 // powers of two from POOL_MIN_SIZE to 64 KB
+#define POOL_CLASS_BYTES (4 * 1024 * 1024) // free memory kept per class
+#define SEND_IOV_MAX 64 // chunks handed to the kernel per syscall
+
+typedef void (sev_buf_release_cb)(char *data, void *release_data);
+
+struct sev_buf_pool;
+
+// immutable data shared by any number of send queues, possibly on
+// different loops, freed when the last reference is released
+struct sev_buf {
+    int refs;
+    size_t len;
+    char *data;
+
+    // for wrapped memory, called from whichever thread drops the last
+    // reference
+    sev_buf_release_cb *release_cb;
+    void *release_data;
+
+    // pooled buffers go back to their pool instead, see sev_buf_pool_get()
+    struct sev_buf_pool *pool;
+    struct sev_buf *next;
+    size_t size;
+};
+
+// a piece of the send queue
+struct sev_chunk {
+    struct sev_chunk *next;
+
+    // unsent data is data[start..end), or bytes start..end of fd or buf
+    size_t start;
+    size_t end;
+    size_t size;
+
+    // file to sendfile() from, -1 for data chunks
+    int fd;
+
+    // shared buffer referenced instead of copied, data is unused
+    struct sev_buf *buf;
+
+    char data[];
+};
+
+// free buffers by size class, owned by a single loop
+struct sev_buffer_pool {
+    void *free[POOL_CLASSES];
+    size_t count[POOL_CLASSES];
+
+    // headers of chunks referencing a sev_buf
+    struct sev_chunk *refs;
+    size_t ref_count;
+};
+
+// sev_bufs by size class, taken by the loop that owns the pool and
+// released from any thread; lives on until the owner and every buffer
+// taken from it let go
+struct sev_buf_pool {
+    int refs;
+
+    // only touched by the owner
+    struct sev_buf *free[POOL_CLASSES];
+    size_t count[POOL_CLASSES];
+
+    // released buffers, picked up by the owner when a class runs out
+    struct sev_buf *returned;
+};
+
+// unsent data of a stream, in order
+struct sev_queue {
+    struct sev_chunk *head;
+    struct sev_chunk *tail;
+
+    // bytes held in data chunks, file ranges don't count
+    size_t len;
+};
+
+// returns a buffer with one reference, data is copied in unless NULL, in
+// which case it can be filled before it is first sent
+struct sev_buf *sev_buf_new(const char *data, size_t len);
+
+// refers to memory owned by the application, which gets it back through
+// release_cb once nothing (the kernel included, for zero copy sends) uses it
+struct sev_buf *sev_buf_wrap(char *data, size_t len,
+    sev_buf_release_cb *release_cb, void *release_data);
+
+struct sev_buf *sev_buf_retain(struct sev_buf *buf);
+
+void sev_buf_release(struct sev_buf *buf);
+
+// whether anything besides the caller holds a reference
+int sev_buf_shared(struct sev_buf *buf);
+
+struct sev_buf_pool *sev_buf_pool_new(void);
+
+// drops the owner's reference, buffers still out keep the pool
+void sev_buf_pool_free(struct sev_buf_pool *pool);
+
+// like sev_buf_new(NULL, len), from the owner's thread only
+struct sev_buf *sev_buf_pool_get(struct sev_buf_pool *pool, size_t len);
+
+// size rounded up to its class, buffers past the largest class aren't pooled
+size_t sev_buffer_size(size_t size);
+
+void *sev_buffer_get(struct sev_buffer_pool *pool, size_t size);
+
+// size must be the one the buffer was taken with
+void sev_buffer_put(struct sev_buffer_pool *pool, void *buffer, size_t size);
+
+void sev_buffer_pool_clear(struct sev_buffer_pool *pool);
+
+struct sev_chunk *sev_chunk_get(struct sev_buffer_pool *pool);
+
+void sev_chunk_put(struct sev_buffer_pool *pool, struct sev_chunk *chunk);
+
+int sev_queue_append(struct sev_queue *queue, struct sev_buffer_pool *pool,
+    const char *data, size_t len);
+
+// queues bytes offset..len of buf, taking a reference
+int sev_queue_append_buf(struct sev_queue *queue,
+    struct sev_buffer_pool *pool, struct sev_buf *buf, size_t offset);
+
+int sev_queue_append_file(struct sev_queue *queue,
+    struct sev_buffer_pool *pool, int fd, off_t offset, size_t len);
+
+// fills iov with the data chunks at the front of the queue, up to the first
+// file chunk, returns the number of entries used
+int sev_queue_iov(struct sev_queue *queue, struct iovec *iov, int max);
+
+// drops n bytes from the front of the queue
+void sev_queue_consume(struct sev_queue *queue, struct sev_buffer_pool *pool,
+    size_t n);
+
+// drops the chunk at the front of the queue
+void sev_queue_pop(struct sev_queue *queue, struct sev_buffer_pool *pool);
+
+void sev_queue_clear(struct sev_queue *queue, struct sev_buffer_pool *pool);
+
+#endif
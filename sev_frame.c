@@ -0,0 +1,429 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "sev_frame.h"
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
+int sev_frame_length(struct sev_frame *frame, int header_size,
+    size_t max_size)
+{
+    if (header_size != 1 && header_size != 2 && header_size != 4 &&
+            header_size != 8) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    frame->mode = SEV_FRAME_LENGTH;
+    frame->header_size = header_size;
+    frame->max_size = max_size ? max_size : FRAME_MAX_SIZE;
+
+    return 0;
+}
+
+int sev_frame_delimiter(struct sev_frame *frame, const char *delimiter,
+    size_t max_size)
+{
+    size_t len = strlen(delimiter);
+
+    if (len == 0 || len > FRAME_DELIMITER_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    frame->mode = SEV_FRAME_DELIMITER;
+    memcpy(frame->delimiter, delimiter, len);
+    frame->delimiter_len = len;
+    frame->max_size = max_size ? max_size : FRAME_MAX_SIZE;
+
+    return 0;
+}
+
+#ifdef __SSE2__
+// matches the first and last delimiter bytes at 16 positions at once, only
+// the candidates get a full compare
+static size_t scan_sse2(const char *data, size_t len, const char *delimiter,
+    size_t delimiter_len)
+{
+    const __m128i first = _mm_set1_epi8(delimiter[0]);
+    const __m128i last = _mm_set1_epi8(delimiter[delimiter_len - 1]);
+    size_t i;
+
+    for (i = 0; i + delimiter_len - 1 + 16 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i b = _mm_loadu_si128(
+            (const __m128i *)(data + i + delimiter_len - 1));
+        unsigned mask = _mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+
+            if (!memcmp(data + i + bit + 1, delimiter + 1, delimiter_len - 2))
+                return i + bit;
+
+            mask &= mask - 1;
+        }
+    }
+
+    // less than a vector left
+    const char *p = memmem(data + i, len - i, delimiter, delimiter_len);
+
+    return p ? (size_t)(p - data) : len;
+}
+#endif
+
+size_t sev_frame_scan(const char *data, size_t len, const char *delimiter,
+    size_t delimiter_len)
+{
+    const char *p;
+
+    // glibc's memchr is vectorized already
+    if (delimiter_len == 1) {
+        p = memchr(data, delimiter[0], len);
+        return p ? (size_t)(p - data) : len;
+    }
+
+#ifdef __SSE2__
+    return scan_sse2(data, len, delimiter, delimiter_len);
+#else
+    p = memmem(data, len, delimiter, delimiter_len);
+    return p ? (size_t)(p - data) : len;
+#endif
+}
+
+// makes room for size bytes plus a terminating null byte
+static int frame_reserve(struct sev_frame *frame,
+    struct sev_buffer_pool *pool, size_t size)
+{
+    if (size < frame->size)
+        return 0;
+
+    size_t grown = sev_buffer_size(MAX(size + 1, frame->size * 2));
+    char *buffer = sev_buffer_get(pool, grown);
+    if (!buffer) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (frame->buffer) {
+        memcpy(buffer, frame->buffer, frame->len);
+        sev_buffer_put(pool, frame->buffer, frame->size);
+    }
+
+    frame->buffer = buffer;
+    frame->size = grown;
+
+    return 0;
+}
+
+static int frame_append(struct sev_frame *frame,
+    struct sev_buffer_pool *pool, const char *data, size_t len)
+{
+    if (len == 0)
+        return 0;
+
+    if (frame_reserve(frame, pool, frame->len + len) == -1)
+        return -1;
+
+    memcpy(frame->buffer + frame->len, data, len);
+    frame->len += len;
+
+    return 0;
+}
+
+static uint64_t frame_header(const char *data, int size)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    uint64_t len = 0;
+    int i;
+
+    for (i = 0; i < size; i++)
+        len = len << 8 | p[i];
+
+    return len;
+}
+
+// length of the whole frame at the start of data, 0 if it is incomplete;
+// the payload is data[*offset..*offset + *payload)
+static ssize_t frame_next(struct sev_frame *frame, const char *data,
+    size_t len, size_t *offset, size_t *payload)
+{
+    if (frame->mode == SEV_FRAME_LENGTH) {
+        size_t header_size = frame->header_size;
+
+        if (len < header_size)
+            return 0;
+
+        uint64_t n = frame_header(data, header_size);
+        if (n > frame->max_size) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+
+        if (len - header_size < n)
+            return 0;
+
+        *offset = header_size;
+        *payload = n;
+        return header_size + n;
+    }
+
+    size_t n = sev_frame_scan(data, len, frame->delimiter,
+        frame->delimiter_len);
+
+    // without a delimiter, the tail may still be the start of one
+    if (n > frame->max_size + (n == len ? frame->delimiter_len - 1 : 0)) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if (n == len)
+        return 0;
+
+    *offset = 0;
+    *payload = n;
+    return n + frame->delimiter_len;
+}
+
+// moves the bytes of data that belong to the buffered frame into the
+// buffer, returns how many were taken; done is set once the frame is whole
+static ssize_t frame_fill(struct sev_frame *frame,
+    struct sev_buffer_pool *pool, const char *data, size_t len, int *done)
+{
+    size_t take = 0;
+
+    *done = 0;
+
+    if (frame->mode == SEV_FRAME_LENGTH) {
+        size_t header_size = frame->header_size;
+
+        if (frame->len < header_size) {
+            take = MIN(header_size - frame->len, len);
+            if (frame_append(frame, pool, data, take) == -1)
+                return -1;
+
+            if (frame->len < header_size)
+                return take;
+        }
+
+        uint64_t n = frame_header(frame->buffer, header_size);
+        if (n > frame->max_size) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+
+        // reserve the whole frame at once
+        size_t total = header_size + n;
+        size_t rest = MIN(total - frame->len, len - take);
+
+        if (frame_reserve(frame, pool, total) == -1 ||
+                frame_append(frame, pool, data + take, rest) == -1)
+            return -1;
+
+        *done = frame->len == total;
+        return take + rest;
+    }
+
+    size_t delimiter_len = frame->delimiter_len;
+    size_t n = len;
+
+    // the buffer holds no whole delimiter, but may end with part of one
+    if (delimiter_len > 1) {
+        char edge[2 * FRAME_DELIMITER_MAX];
+        size_t tail = MIN(frame->len, delimiter_len - 1);
+        size_t head = MIN(len, delimiter_len - 1);
+
+        memcpy(edge, frame->buffer + frame->len - tail, tail);
+        memcpy(edge + tail, data, head);
+
+        size_t found = sev_frame_scan(edge, tail + head, frame->delimiter,
+            delimiter_len);
+
+        if (found < tail) {
+            take = found + delimiter_len - tail;
+            *done = 1;
+        }
+    }
+
+    if (!*done) {
+        n = sev_frame_scan(data, len, frame->delimiter, delimiter_len);
+
+        if (n < len) {
+            take = n + delimiter_len;
+            *done = 1;
+        }
+        else {
+            take = len;
+        }
+    }
+
+    size_t limit = frame->max_size + (*done ? delimiter_len : delimiter_len - 1);
+    if (frame->len + take > limit) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if (frame_append(frame, pool, data, take) == -1)
+        return -1;
+
+    return take;
+}
+
+// keeps what follows a stop for the next call
+static int frame_stash(struct sev_frame *frame,
+    struct sev_buffer_pool *pool, const char *data, size_t len)
+{
+    if (len == 0)
+        return 0;
+
+    if (frame_append(frame, pool, data, len) == -1)
+        return -1;
+
+    frame->stashed = 1;
+    return 0;
+}
+
+static int frame_parse(struct sev_frame *frame,
+    struct sev_buffer_pool *pool, char *data, size_t len, sev_frame_cb *cb,
+    void *cb_data)
+{
+    size_t offset, payload;
+    ssize_t n;
+
+    if (len == 0)
+        return 0;
+
+    // finish the frame started by an earlier call
+    if (frame->len > 0) {
+        int done;
+
+        n = frame_fill(frame, pool, data, len, &done);
+        if (n == -1)
+            return -1;
+
+        if (!done)
+            return 0;
+
+        data += n;
+        len -= n;
+
+        if (frame->mode == SEV_FRAME_LENGTH) {
+            offset = frame->header_size;
+            payload = frame->len - offset;
+        }
+        else {
+            offset = 0;
+            payload = frame->len - frame->delimiter_len;
+        }
+
+        frame->buffer[offset + payload] = '\0';
+        frame->len = 0;
+
+        if (cb(cb_data, frame->buffer + offset, payload))
+            return frame_stash(frame, pool, data, len);
+    }
+
+    // frames that are whole in data are handed out in place
+    while (len > 0) {
+        n = frame_next(frame, data, len, &offset, &payload);
+        if (n == -1)
+            return -1;
+
+        if (n == 0)
+            break;
+
+        // the byte after the payload is the delimiter, the next header or
+        // the spare one past the data
+        char saved = data[offset + payload];
+        data[offset + payload] = '\0';
+
+        int stop = cb(cb_data, data + offset, payload);
+
+        data[offset + payload] = saved;
+        data += n;
+        len -= n;
+
+        if (stop)
+            return frame_stash(frame, pool, data, len);
+    }
+
+    if (frame_append(frame, pool, data, len) == -1)
+        return -1;
+
+    // idle streams don't hold on to a buffer
+    if (frame->len == 0 && frame->buffer)
+        sev_frame_clear(frame, pool);
+
+    return 0;
+}
+
+int sev_frame_feed(struct sev_frame *frame, struct sev_buffer_pool *pool,
+    char *data, size_t len, sev_frame_cb *cb, void *cb_data)
+{
+    if (frame->stashed) {
+        // replay the leftovers of the last stop first
+        char *buffer = frame->buffer;
+        size_t size = frame->size;
+        size_t stashed = frame->len;
+
+        frame->buffer = NULL;
+        frame->size = 0;
+        frame->len = 0;
+        frame->stashed = 0;
+
+        int ret = frame_parse(frame, pool, buffer, stashed, cb, cb_data);
+
+        // stopped again
+        if (ret == 0 && frame->stashed)
+            ret = frame_append(frame, pool, data, len);
+
+        sev_buffer_put(pool, buffer, size);
+
+        if (ret == -1 || frame->stashed)
+            return ret;
+    }
+
+    return frame_parse(frame, pool, data, len, cb, cb_data);
+}
+
+void sev_frame_clear(struct sev_frame *frame, struct sev_buffer_pool *pool)
+{
+    if (frame->buffer)
+        sev_buffer_put(pool, frame->buffer, frame->size);
+
+    frame->buffer = NULL;
+    frame->size = 0;
+    frame->len = 0;
+    frame->stashed = 0;
+}
@@ -0,0 +1,86 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SEV_FRAME_H
+#define SEV_FRAME_H
+
+#include "sev_buffer.h"
+
+#define FRAME_MAX_SIZE (1024 * 1024) // default limit of a single frame
+#define FRAME_DELIMITER_MAX 8
+
+enum sev_frame_mode {
+    SEV_FRAME_NONE,      // hand out whatever recv() returned
+    SEV_FRAME_LENGTH,    // big endian length header, then the payload
+    SEV_FRAME_DELIMITER, // payload, then the delimiter
+};
+
+// splits a byte stream into messages; the settings can be copied around,
+// the reassembly state belongs to one stream
+struct sev_frame {
+    enum sev_frame_mode mode;
+
+    // header bytes in length mode: 1, 2, 4 or 8
+    int header_size;
+
+    char delimiter[FRAME_DELIMITER_MAX];
+    size_t delimiter_len;
+
+    // longest payload accepted, longer frames fail with EMSGSIZE
+    size_t max_size;
+
+    // the frame being reassembled
+    char *buffer;
+    size_t size;
+    size_t len;
+
+    // set if the buffer holds unparsed data left over by a stop
+    int stashed;
+};
+
+// called with each payload, null terminated; a non-zero return stops the
+// parser, the rest of the data is kept for the next sev_frame_feed()
+typedef int (sev_frame_cb)(void *data, char *payload, size_t len);
+
+// max_size 0 means FRAME_MAX_SIZE
+int sev_frame_length(struct sev_frame *frame, int header_size,
+    size_t max_size);
+
+int sev_frame_delimiter(struct sev_frame *frame, const char *delimiter,
+    size_t max_size);
+
+// parses data, copying only frames that span calls; data[len] must be
+// writable. returns -1 and sets errno on failure
+int sev_frame_feed(struct sev_frame *frame, struct sev_buffer_pool *pool,
+    char *data, size_t len, sev_frame_cb *cb, void *cb_data);
+
+// drops the reassembly state, keeping the settings
+void sev_frame_clear(struct sev_frame *frame, struct sev_buffer_pool *pool);
+
+// offset of the first occurrence of delimiter in data, len if there is none
+size_t sev_frame_scan(const char *data, size_t len, const char *delimiter,
+    size_t delimiter_len);
+
+#endif
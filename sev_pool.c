@@ -0,0 +1,178 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include "sev_pool.h"
+
+struct sev_slab {
+    struct sev_pool *pool;
+
+    // neighbors in the pool's partial list
+    struct sev_slab *prev;
+    struct sev_slab *next;
+
+    void *free;
+    size_t used;
+};
+
+// objects start at the first cache line after the header
+#define SLAB_HEADER \
+    ((sizeof(struct sev_slab) + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1))
+
+static struct sev_slab *slab_of(void *object)
+{
+    return (struct sev_slab *)((uintptr_t)object & ~(uintptr_t)(SLAB_SIZE - 1));
+}
+
+static void partial_add(struct sev_pool *pool, struct sev_slab *slab)
+{
+    slab->prev = NULL;
+    slab->next = pool->partial;
+
+    if (pool->partial)
+        pool->partial->prev = slab;
+
+    pool->partial = slab;
+}
+
+static void partial_remove(struct sev_pool *pool, struct sev_slab *slab)
+{
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        pool->partial = slab->next;
+
+    if (slab->next)
+        slab->next->prev = slab->prev;
+}
+
+static struct sev_slab *slab_new(struct sev_pool *pool)
+{
+    void *memory;
+    if (posix_memalign(&memory, SLAB_SIZE, SLAB_SIZE))
+        return NULL;
+
+    struct sev_slab *slab = memory;
+    slab->pool = pool;
+    slab->free = NULL;
+    slab->used = 0;
+
+    // thread every object onto the slab's free list
+    size_t i;
+    for (i = pool->per_slab; i > 0; i--) {
+        void *object = (char *)slab + SLAB_HEADER +
+            (i - 1) * pool->object_size;
+
+        *(void **)object = slab->free;
+        slab->free = object;
+    }
+
+    partial_add(pool, slab);
+    pool->free_count += pool->per_slab;
+
+    return slab;
+}
+
+void sev_pool_init(struct sev_pool *pool, size_t object_size,
+    size_t capacity)
+{
+    pool->object_size = (object_size + CACHE_LINE - 1) &
+        ~(size_t)(CACHE_LINE - 1);
+    pool->per_slab = (SLAB_SIZE - SLAB_HEADER) / pool->object_size;
+    pool->capacity = capacity;
+    pool->free_count = 0;
+    pool->partial = NULL;
+}
+
+int sev_pool_prewarm(struct sev_pool *pool, size_t count)
+{
+    while (pool->free_count < count) {
+        if (!slab_new(pool))
+            return -1;
+    }
+
+    return 0;
+}
+
+void *sev_pool_get(struct sev_pool *pool)
+{
+    struct sev_slab *slab = pool->partial;
+
+    if (!slab) {
+        slab = slab_new(pool);
+        if (!slab)
+            return NULL;
+    }
+
+    void *object = slab->free;
+    slab->free = *(void **)object;
+    slab->used++;
+    pool->free_count--;
+
+    // the slab is full
+    if (!slab->free)
+        partial_remove(pool, slab);
+
+    return object;
+}
+
+void sev_pool_put(void *object)
+{
+    struct sev_slab *slab = slab_of(object);
+    struct sev_pool *pool = slab->pool;
+
+    // the slab was full
+    if (!slab->free)
+        partial_add(pool, slab);
+
+    *(void **)object = slab->free;
+    slab->free = object;
+    slab->used--;
+    pool->free_count++;
+
+    // give the slab back if the pool is holding too many free objects
+    if (slab->used == 0 && pool->free_count - pool->per_slab >= pool->capacity) {
+        partial_remove(pool, slab);
+        pool->free_count -= pool->per_slab;
+        free(slab);
+    }
+}
+
+void sev_pool_clear(struct sev_pool *pool)
+{
+    struct sev_slab *slab = pool->partial;
+
+    while (slab) {
+        struct sev_slab *next = slab->next;
+
+        if (slab->used == 0) {
+            partial_remove(pool, slab);
+            pool->free_count -= pool->per_slab;
+            free(slab);
+        }
+
+        slab = next;
+    }
+}
@@ -0,0 +1,63 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SEV_POOL_H
+#define SEV_POOL_H
+
+#include <stdlib.h>
+
+#define SLAB_SIZE (64 * 1024) // slabs are aligned to their size
+#define CACHE_LINE 64
+
+struct sev_slab;
+
+// fixed-size objects carved out of slabs, owned by a single loop
+struct sev_pool {
+    size_t object_size;
+    size_t per_slab;
+
+    // free objects kept around, empty slabs past this are released
+    size_t capacity;
+    size_t free_count;
+
+    // slabs with at least one free object
+    struct sev_slab *partial;
+};
+
+void sev_pool_init(struct sev_pool *pool, size_t object_size,
+    size_t capacity);
+
+// makes sure count objects can be taken without allocating
+int sev_pool_prewarm(struct sev_pool *pool, size_t count);
+
+// objects are cache line aligned and not zeroed
+void *sev_pool_get(struct sev_pool *pool);
+
+void sev_pool_put(void *object);
+
+// releases the free slabs, objects still in use keep theirs
+void sev_pool_clear(struct sev_pool *pool);
+
+#endif
@@ -0,0 +1,363 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include "sev.h"
+#include "sev_resolve.h"
+
+struct cache_entry {
+    char host[NI_MAXHOST];
+    double expires;
+    struct sev_addrlist addrs;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int started;
+    int threads;
+    double ttl;
+
+    // pending lookups, in order
+    struct sev_resolve *head;
+    struct sev_resolve *tail;
+
+    // lookups the threads are working on
+    struct sev_resolve *running;
+
+    struct cache_entry cache[RESOLVE_CACHE_SIZE];
+} resolver = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .threads = RESOLVE_THREADS,
+    .ttl = RESOLVE_TTL,
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static unsigned hash(const char *host)
+{
+    unsigned h = 5381;
+
+    while (*host)
+        h = h * 33 + (unsigned char)*host++;
+
+    return h % RESOLVE_CACHE_SIZE;
+}
+
+// called with the lock held
+static int cache_get(const char *host, struct sev_addrlist *addrs)
+{
+    struct cache_entry *entry = &resolver.cache[hash(host)];
+
+    if (strcmp(entry->host, host) || entry->expires < now())
+        return -1;
+
+    *addrs = entry->addrs;
+
+    return 0;
+}
+
+// called with the lock held
+static void cache_put(const char *host, struct sev_addrlist *addrs)
+{
+    struct cache_entry *entry = &resolver.cache[hash(host)];
+
+    strcpy(entry->host, host);
+    entry->expires = now() + resolver.ttl;
+    entry->addrs = *addrs;
+}
+
+static int numeric(const char *host, struct sev_addrlist *addrs)
+{
+    struct sockaddr_in *s_in = (struct sockaddr_in *)&addrs->addrs[0];
+    struct sockaddr_in6 *s_in6 = (struct sockaddr_in6 *)&addrs->addrs[0];
+
+    memset(addrs, 0, sizeof(struct sev_addrlist));
+
+    if (inet_pton(AF_INET, host, &s_in->sin_addr) == 1) {
+        s_in->sin_family = AF_INET;
+        addrs->lens[0] = sizeof(struct sockaddr_in);
+    }
+    else if (inet_pton(AF_INET6, host, &s_in6->sin6_addr) == 1) {
+        s_in6->sin6_family = AF_INET6;
+        addrs->lens[0] = sizeof(struct sockaddr_in6);
+    }
+    else {
+        return -1;
+    }
+
+    addrs->count = 1;
+
+    return 0;
+}
+
+static int lookup(const char *host, struct sev_addrlist *addrs)
+{
+    struct addrinfo hint = {};
+    hint.ai_family = AF_UNSPEC;
+    hint.ai_socktype = SOCK_STREAM;
+    hint.ai_flags = AI_ADDRCONFIG;
+
+    struct addrinfo *servinfo, *p;
+
+    int rv = getaddrinfo(host, NULL, &hint, &servinfo);
+    if (rv != 0)
+        return rv;
+
+    addrs->count = 0;
+
+    for (p = servinfo; p && addrs->count < RESOLVE_MAX_ADDRS; p = p->ai_next) {
+        if (p->ai_addrlen > sizeof(struct sockaddr_storage))
+            continue;
+
+        memcpy(&addrs->addrs[addrs->count], p->ai_addr, p->ai_addrlen);
+        addrs->lens[addrs->count] = p->ai_addrlen;
+        addrs->count++;
+    }
+
+    freeaddrinfo(servinfo);
+
+    return addrs->count ? 0 : EAI_NONAME;
+}
+
+static void *worker(void *arg)
+{
+    pthread_mutex_lock(&resolver.lock);
+
+    for (;;) {
+        while (!resolver.head)
+            pthread_cond_wait(&resolver.cond, &resolver.lock);
+
+        struct sev_resolve *req = resolver.head;
+        resolver.head = req->next;
+        if (!resolver.head)
+            resolver.tail = NULL;
+
+        // where sev_resolve_detach() can find it
+        req->next = resolver.running;
+        resolver.running = req;
+
+        pthread_mutex_unlock(&resolver.lock);
+
+        // the slow part, without the lock
+        req->error = lookup(req->host, &req->result);
+
+        pthread_mutex_lock(&resolver.lock);
+
+        struct sev_resolve **p = &resolver.running;
+        while (*p != req)
+            p = &(*p)->next;
+        *p = req->next;
+
+        if (!req->error)
+            cache_put(req->host, &req->result);
+
+        // the loop was freed in the meantime
+        struct sev_loop *loop = req->loop;
+        if (!loop) {
+            free(req);
+            continue;
+        }
+
+        // hand the answer back to the loop
+
+        pthread_mutex_lock(&loop->lock);
+        req->next = loop->resolved;
+        loop->resolved = req;
+        pthread_mutex_unlock(&loop->lock);
+
+        ev_async_send(loop->ev, &loop->w_wakeup);
+    }
+
+    return NULL;
+}
+
+// called with the lock held
+static int start_threads(void)
+{
+    int i;
+
+    for (i = 0; i < resolver.threads; i++) {
+        pthread_t thread;
+
+        if (pthread_create(&thread, NULL, worker, NULL))
+            break;
+
+        pthread_detach(thread);
+    }
+
+    if (i == 0)
+        return -1;
+
+    resolver.started = 1;
+
+    return 0;
+}
+
+void sev_resolver_setup(int threads, double ttl)
+{
+    pthread_mutex_lock(&resolver.lock);
+
+    if (!resolver.started) {
+        if (threads > 0)
+            resolver.threads = threads;
+        if (ttl >= 0)
+            resolver.ttl = ttl;
+    }
+
+    pthread_mutex_unlock(&resolver.lock);
+}
+
+struct sev_resolve *sev_resolve(struct sev_loop *loop, const char *host,
+    sev_resolve_cb *cb, void *data)
+{
+    struct sev_addrlist addrs;
+
+    if (strlen(host) >= NI_MAXHOST) {
+        cb(data, EAI_NONAME, NULL);
+        return NULL;
+    }
+
+    if (numeric(host, &addrs) == 0) {
+        cb(data, 0, &addrs);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&resolver.lock);
+
+    if (cache_get(host, &addrs) == 0) {
+        pthread_mutex_unlock(&resolver.lock);
+        cb(data, 0, &addrs);
+        return NULL;
+    }
+
+    struct sev_resolve *req = calloc(1, sizeof(struct sev_resolve));
+
+    if (!req || (!resolver.started && start_threads() == -1)) {
+        pthread_mutex_unlock(&resolver.lock);
+        free(req);
+        cb(data, EAI_SYSTEM, NULL);
+        return NULL;
+    }
+
+    req->loop = loop;
+    strcpy(req->host, host);
+    req->cb = cb;
+    req->data = data;
+
+    if (resolver.tail)
+        resolver.tail->next = req;
+    else
+        resolver.head = req;
+
+    resolver.tail = req;
+
+    pthread_cond_signal(&resolver.cond);
+    pthread_mutex_unlock(&resolver.lock);
+
+    // the wakeup watcher doesn't keep the loop alive, the lookup does
+    ev_ref(loop->ev);
+
+    return req;
+}
+
+void sev_resolve_cancel(struct sev_resolve *req)
+{
+    if (!req->cancelled)
+        ev_unref(req->loop->ev);
+
+    req->cancelled = 1;
+}
+
+void sev_resolve_detach(struct sev_loop *loop)
+{
+    struct sev_resolve **p, *req;
+
+    pthread_mutex_lock(&resolver.lock);
+
+    // queued lookups are dropped, running ones are freed once they finish
+    p = &resolver.head;
+    resolver.tail = NULL;
+
+    while ((req = *p)) {
+        if (req->loop == loop) {
+            *p = req->next;
+            free(req);
+            continue;
+        }
+
+        resolver.tail = req;
+        p = &req->next;
+    }
+
+    for (req = resolver.running; req; req = req->next) {
+        if (req->loop == loop)
+            req->loop = NULL;
+    }
+
+    pthread_mutex_unlock(&resolver.lock);
+
+    // answers are handed over with the resolver lock held, none can be on
+    // their way anymore
+    req = loop->resolved;
+    loop->resolved = NULL;
+
+    while (req) {
+        struct sev_resolve *next = req->next;
+
+        free(req);
+        req = next;
+    }
+}
+
+void sev_resolve_dispatch(struct sev_loop *loop)
+{
+    pthread_mutex_lock(&loop->lock);
+    struct sev_resolve *req = loop->resolved;
+    loop->resolved = NULL;
+    pthread_mutex_unlock(&loop->lock);
+
+    while (req) {
+        struct sev_resolve *next = req->next;
+
+        if (!req->cancelled) {
+            ev_unref(loop->ev);
+            req->cb(req->data, req->error, req->error ? NULL : &req->result);
+        }
+
+        free(req);
+        req = next;
+    }
+}
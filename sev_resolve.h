@@ -0,0 +1,82 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SEV_RESOLVE_H
+#define SEV_RESOLVE_H
+
+#include <sys/socket.h>
+#include <netdb.h>
+
+#define RESOLVE_THREADS 2
+#define RESOLVE_TTL 60.0 // seconds a cached answer is used for
+#define RESOLVE_CACHE_SIZE 256
+#define RESOLVE_MAX_ADDRS 8
+
+struct sev_loop;
+struct sev_resolve;
+
+struct sev_addrlist {
+    int count;
+    struct sockaddr_storage addrs[RESOLVE_MAX_ADDRS];
+    socklen_t lens[RESOLVE_MAX_ADDRS];
+};
+
+// error is 0 or an EAI_* code, addrs have their port set to 0
+typedef void (sev_resolve_cb)(void *data, int error,
+    struct sev_addrlist *addrs);
+
+struct sev_resolve {
+    struct sev_resolve *next;
+    struct sev_loop *loop;
+
+    char host[NI_MAXHOST];
+    int error;
+    struct sev_addrlist result;
+
+    sev_resolve_cb *cb;
+    void *data;
+    int cancelled;
+};
+
+// sets the number of resolver threads and the cache ttl, only has an effect
+// before the first lookup
+void sev_resolver_setup(int threads, double ttl);
+
+// looks host up on a resolver thread, cb is called on the loop's thread,
+// which is kept running until then; numeric addresses and cached names are
+// answered right away and NULL is returned
+struct sev_resolve *sev_resolve(struct sev_loop *loop, const char *host,
+    sev_resolve_cb *cb, void *data);
+
+// cb won't be called, only valid until cb would have been called
+void sev_resolve_cancel(struct sev_resolve *req);
+
+// drops the loop's lookups without calling back, for sev_loop_free()
+void sev_resolve_detach(struct sev_loop *loop);
+
+// runs the callbacks of finished lookups, called by the loop on wakeup
+void sev_resolve_dispatch(struct sev_loop *loop);
+
+#endif
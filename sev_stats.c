@@ -0,0 +1,257 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include "sev_stats.h"
+
+#define SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define VALUE_MAX ((UINT64_C(1) << HISTOGRAM_MAX_BITS) - 1)
+
+static const char *close_names[SEV_CLOSE_CODES] = {
+    "local", "peer", "error", "send_full", "timeout", "connect", "frame",
+};
+
+uint64_t sev_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// small values get a bucket each, larger ones SUB_COUNT per power of two
+static int bucket_index(uint64_t value)
+{
+    if (value < SUB_COUNT)
+        return value;
+
+    int bits = 63 - __builtin_clzll(value);
+    int shift = bits - HISTOGRAM_SUB_BITS;
+
+    return ((shift + 1) << HISTOGRAM_SUB_BITS) +
+        (int)((value >> shift) - SUB_COUNT);
+}
+
+// highest value that lands in the bucket
+static uint64_t bucket_value(int index)
+{
+    int group = index >> HISTOGRAM_SUB_BITS;
+    uint64_t sub = index & (SUB_COUNT - 1);
+
+    if (group == 0)
+        return sub;
+
+    return ((SUB_COUNT + sub + 1) << (group - 1)) - 1;
+}
+
+void sev_histogram_add(struct sev_histogram *histogram, uint64_t value)
+{
+    if (value > VALUE_MAX)
+        value = VALUE_MAX;
+
+    histogram->count++;
+    histogram->sum += value;
+    histogram->buckets[bucket_index(value)]++;
+
+    if (value > histogram->max)
+        histogram->max = value;
+}
+
+uint64_t sev_histogram_percentile(const struct sev_histogram *histogram,
+    double fraction)
+{
+    uint64_t rank = fraction * histogram->count;
+    uint64_t seen = 0;
+    int i;
+
+    if (rank >= histogram->count)
+        return histogram->max;
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+
+        if (seen > rank) {
+            uint64_t value = bucket_value(i);
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+
+    return histogram->max;
+}
+
+void sev_counters_add(struct sev_counters *total,
+    const struct sev_counters *counters)
+{
+    int i;
+
+    total->bytes_in += counters->bytes_in;
+    total->bytes_out += counters->bytes_out;
+    total->reads += counters->reads;
+    total->writes += counters->writes;
+    total->read_eagain += counters->read_eagain;
+    total->write_eagain += counters->write_eagain;
+    total->partial_writes += counters->partial_writes;
+    total->zerocopy_sends += counters->zerocopy_sends;
+    total->zerocopy_copied += counters->zerocopy_copied;
+    total->accepts += counters->accepts;
+    total->datagrams_in += counters->datagrams_in;
+    total->datagrams_out += counters->datagrams_out;
+    total->datagrams_dropped += counters->datagrams_dropped;
+    total->read_errors += counters->read_errors;
+    total->throttles += counters->throttles;
+
+    for (i = 0; i < SEV_CLOSE_CODES; i++)
+        total->closes[i] += counters->closes[i];
+
+    if (counters->queued_max > total->queued_max)
+        total->queued_max = counters->queued_max;
+}
+
+const char *sev_close_code_name(enum sev_close_code code)
+{
+    if (code < 0 || code >= SEV_CLOSE_CODES)
+        return "unknown";
+
+    return close_names[code];
+}
+
+static int format_histogram(const char *name,
+    const struct sev_histogram *histogram, char *buffer, size_t size)
+{
+    uint64_t mean = histogram->count ? histogram->sum / histogram->count : 0;
+
+    return snprintf(buffer, size,
+        "%s_count %llu\n%s_mean_ns %llu\n%s_p50_ns %llu\n%s_p90_ns %llu\n"
+        "%s_p99_ns %llu\n%s_p999_ns %llu\n%s_max_ns %llu\n",
+        name, (unsigned long long)histogram->count,
+        name, (unsigned long long)mean,
+        name, (unsigned long long)sev_histogram_percentile(histogram, 0.5),
+        name, (unsigned long long)sev_histogram_percentile(histogram, 0.9),
+        name, (unsigned long long)sev_histogram_percentile(histogram, 0.99),
+        name, (unsigned long long)sev_histogram_percentile(histogram, 0.999),
+        name, (unsigned long long)histogram->max);
+}
+
+int sev_stats_format(const struct sev_stats *stats, char *buffer,
+    size_t size)
+{
+    const struct sev_counters *c = &stats->counters;
+    size_t len = 0;
+    int i, n;
+
+// keeps appending after a truncation, so the total length comes out right
+#define APPEND(expr) do { \
+        n = (expr); \
+        if (n < 0) \
+            return -1; \
+        len += n; \
+    } while (0)
+#define REST (len < size ? buffer + len : NULL), (len < size ? size - len : 0)
+
+    APPEND(snprintf(REST,
+        "bytes_in %llu\nbytes_out %llu\nreads %llu\nwrites %llu\n"
+        "read_eagain %llu\nwrite_eagain %llu\npartial_writes %llu\n"
+        "queued_max %llu\nzerocopy_sends %llu\nzerocopy_copied %llu\n"
+        "accepts %llu\ndatagrams_in %llu\ndatagrams_out %llu\n"
+        "datagrams_dropped %llu\nread_errors %llu\nthrottles %llu\n",
+        (unsigned long long)c->bytes_in, (unsigned long long)c->bytes_out,
+        (unsigned long long)c->reads, (unsigned long long)c->writes,
+        (unsigned long long)c->read_eagain,
+        (unsigned long long)c->write_eagain,
+        (unsigned long long)c->partial_writes,
+        (unsigned long long)c->queued_max,
+        (unsigned long long)c->zerocopy_sends,
+        (unsigned long long)c->zerocopy_copied,
+        (unsigned long long)c->accepts,
+        (unsigned long long)c->datagrams_in,
+        (unsigned long long)c->datagrams_out,
+        (unsigned long long)c->datagrams_dropped,
+        (unsigned long long)c->read_errors,
+        (unsigned long long)c->throttles));
+
+    for (i = 0; i < SEV_CLOSE_CODES; i++) {
+        APPEND(snprintf(REST, "closes_%s %llu\n", close_names[i],
+            (unsigned long long)c->closes[i]));
+    }
+
+    if (stats->iteration.count)
+        APPEND(format_histogram("iteration", &stats->iteration, REST));
+
+    if (stats->callback.count)
+        APPEND(format_histogram("callback", &stats->callback, REST));
+
+#undef APPEND
+#undef REST
+
+    return len;
+}
+
+// seconds to ns, negative spans (clocks stepping) count as 0
+static uint64_t span_ns(double from, double to)
+{
+    return to > from ? (uint64_t)((to - from) * 1e9) : 0;
+}
+
+void sev_timing_arrival(struct sev_timing *timing, double arrival,
+    double woke, double now)
+{
+    // data can arrive while the loop is already awake
+    sev_histogram_add(&timing->queued, span_ns(arrival, woke));
+    sev_histogram_add(&timing->waiting,
+        span_ns(arrival > woke ? arrival : woke, now));
+}
+
+int sev_timing_format(const struct sev_timing *timing, char *buffer,
+    size_t size)
+{
+    const struct {
+        const char *name;
+        const struct sev_histogram *histogram;
+    } parts[] = {
+        {"queued", &timing->queued},
+        {"waiting", &timing->waiting},
+        {"callback", &timing->callback},
+        {"sent", &timing->sent},
+        {"acked", &timing->acked},
+    };
+    size_t len = 0;
+    size_t i;
+
+    for (i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+        if (!parts[i].histogram->count)
+            continue;
+
+        int n = format_histogram(parts[i].name, parts[i].histogram,
+            len < size ? buffer + len : NULL, len < size ? size - len : 0);
+        if (n < 0)
+            return -1;
+
+        len += n;
+    }
+
+    return len;
+}
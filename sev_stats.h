@@ -0,0 +1,144 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SEV_STATS_H
+#define SEV_STATS_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define HISTOGRAM_SUB_BITS 4 // 16 buckets per power of two, ~6% error
+#define HISTOGRAM_MAX_BITS 40 // values in ns, up to ~18 minutes
+#define HISTOGRAM_BUCKETS \
+    ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+// why a stream was closed
+enum sev_close_code {
+    SEV_CLOSE_LOCAL,     // sev_close() by the application
+    SEV_CLOSE_PEER,      // end of stream or reset by the peer
+    SEV_CLOSE_ERROR,     // any other socket or allocation error
+    SEV_CLOSE_SEND_FULL, // send queue past send_limit
+    SEV_CLOSE_TIMEOUT,   // see the SEV_*_TIMEOUT reasons
+    SEV_CLOSE_CONNECT,   // sev_connect() failed
+    SEV_CLOSE_FRAME,     // malformed or oversized frame
+    SEV_CLOSE_CODES,
+};
+
+// plain counters, kept per stream, per server and per loop
+struct sev_counters {
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+
+    // syscalls, and the ones that found the socket empty or full
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t read_eagain;
+    uint64_t write_eagain;
+
+    // sends the kernel only took part of
+    uint64_t partial_writes;
+
+    // high-water mark of a send queue, in bytes
+    uint64_t queued_max;
+
+    // MSG_ZEROCOPY sends, and the ones the kernel ended up copying anyway
+    uint64_t zerocopy_sends;
+    uint64_t zerocopy_copied;
+
+    // times a stream stopped reading over its read limits
+    uint64_t throttles;
+
+    uint64_t accepts;
+    uint64_t closes[SEV_CLOSE_CODES];
+
+    uint64_t datagrams_in;
+    uint64_t datagrams_out;
+
+    // datagrams the kernel dropped for lack of receive buffer space
+    uint64_t datagrams_dropped;
+
+    // failed reads on datagram sockets, which stay open through them
+    uint64_t read_errors;
+};
+
+// log-linear histogram, in the spirit of HdrHistogram
+struct sev_histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+// snapshot of a loop, see sev_loop_stats()
+struct sev_stats {
+    struct sev_counters counters;
+
+    // time spent handling each loop iteration and in application
+    // callbacks, in ns; empty unless enabled with sev_loop_histograms()
+    struct sev_histogram iteration;
+    struct sev_histogram callback;
+};
+
+// where the time of timestamped reads and sends goes, in ns; arrival is the
+// kernel's receive time, see sev_server_timestamps()
+struct sev_timing {
+    struct sev_histogram queued;   // arrival to the loop waking up
+    struct sev_histogram waiting;  // wakeup (or arrival, if later) to read_cb
+    struct sev_histogram callback; // read_cb itself
+
+    // sampled sends, from the send call to the data leaving the stack and
+    // to the peer acking it
+    struct sev_histogram sent;
+    struct sev_histogram acked;
+};
+
+// monotonic clock in ns
+uint64_t sev_clock(void);
+
+void sev_histogram_add(struct sev_histogram *histogram, uint64_t value);
+
+// value below which the given fraction of samples fall, e.g. 0.99
+uint64_t sev_histogram_percentile(const struct sev_histogram *histogram,
+    double fraction);
+
+void sev_counters_add(struct sev_counters *total,
+    const struct sev_counters *counters);
+
+const char *sev_close_code_name(enum sev_close_code code);
+
+// writes "name value" lines, returns the length like snprintf()
+int sev_stats_format(const struct sev_stats *stats, char *buffer,
+    size_t size);
+
+// adds a read that arrived, was polled and reached its callback at the
+// given wall clock times, in seconds
+void sev_timing_arrival(struct sev_timing *timing, double arrival,
+    double woke, double now);
+
+// the histograms that have samples, like sev_stats_format()
+int sev_timing_format(const struct sev_timing *timing, char *buffer,
+    size_t size);
+
+#endif
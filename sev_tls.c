@@ -0,0 +1,206 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef SEV_TLS
+
+#include <stdlib.h>
+#include <errno.h>
+#include <openssl/err.h>
+#include "sev_tls.h"
+
+static SSL_CTX *ctx_new(const SSL_METHOD *method)
+{
+    SSL_CTX *ctx = SSL_CTX_new(method);
+    if (!ctx)
+        return NULL;
+
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+
+    return ctx;
+}
+
+SSL_CTX *sev_tls_server_ctx(const char *cert_file, const char *key_file)
+{
+    SSL_CTX *ctx = ctx_new(TLS_server_method());
+    if (!ctx)
+        return NULL;
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1 ||
+            SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+            SSL_CTX_check_private_key(ctx) != 1) {
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+SSL_CTX *sev_tls_client_ctx(const char *ca_file)
+{
+    SSL_CTX *ctx = ctx_new(TLS_client_method());
+    if (!ctx)
+        return NULL;
+
+    if (!ca_file)
+        return ctx;
+
+    if (SSL_CTX_load_verify_locations(ctx, ca_file, NULL) != 1) {
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+
+    return ctx;
+}
+
+struct sev_tls *sev_tls_new(SSL_CTX *ctx, int sd, int client,
+    const char *hostname)
+{
+    struct sev_tls *tls = calloc(1, sizeof(struct sev_tls));
+    if (!tls)
+        return NULL;
+
+    tls->ssl = SSL_new(ctx);
+    if (!tls->ssl || SSL_set_fd(tls->ssl, sd) != 1) {
+        sev_tls_free(tls);
+        return NULL;
+    }
+
+    // the send queue retries with whatever is at its head, possibly moved
+    SSL_set_mode(tls->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE |
+        SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    SSL_set_options(tls->ssl, SSL_OP_ENABLE_KTLS);
+
+    if (client && hostname) {
+        SSL_set_tlsext_host_name(tls->ssl, hostname);
+        SSL_set1_host(tls->ssl, hostname);
+    }
+
+    if (client)
+        SSL_set_connect_state(tls->ssl);
+    else
+        SSL_set_accept_state(tls->ssl);
+
+    tls->handshaking = 1;
+
+    return tls;
+}
+
+void sev_tls_free(struct sev_tls *tls)
+{
+    SSL_free(tls->ssl);
+    free(tls);
+}
+
+static int status(struct sev_tls *tls, int rv)
+{
+    switch (SSL_get_error(tls->ssl, rv)) {
+    case SSL_ERROR_WANT_READ:
+        return SEV_TLS_WANT_READ;
+
+    case SSL_ERROR_WANT_WRITE:
+        return SEV_TLS_WANT_WRITE;
+
+    case SSL_ERROR_ZERO_RETURN:
+        return SEV_TLS_CLOSED;
+
+    // end of file without close_notify may be a truncation attack once the
+    // handshake is done
+    case SSL_ERROR_SYSCALL:
+        return errno || !tls->handshaking ? SEV_TLS_ERROR : SEV_TLS_CLOSED;
+
+    default:
+        return SEV_TLS_ERROR;
+    }
+}
+
+int sev_tls_handshake(struct sev_tls *tls)
+{
+    // stale errors would confuse SSL_get_error()
+    ERR_clear_error();
+    errno = 0;
+
+    int rv = SSL_do_handshake(tls->ssl);
+    if (rv != 1)
+        return status(tls, rv);
+
+    tls->handshaking = 0;
+
+#ifndef OPENSSL_NO_KTLS
+    tls->ktls_send = BIO_get_ktls_send(SSL_get_wbio(tls->ssl));
+    tls->ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(tls->ssl));
+#endif
+
+    return SEV_TLS_OK;
+}
+
+int sev_tls_read(struct sev_tls *tls, char *data, size_t len, size_t *n)
+{
+    ERR_clear_error();
+    errno = 0;
+
+    if (SSL_read_ex(tls->ssl, data, len, n) == 1)
+        return SEV_TLS_OK;
+
+    return status(tls, 0);
+}
+
+int sev_tls_write(struct sev_tls *tls, const char *data, size_t len,
+    size_t *n)
+{
+    ERR_clear_error();
+    errno = 0;
+
+    if (SSL_write_ex(tls->ssl, data, len, n) == 1)
+        return SEV_TLS_OK;
+
+    return status(tls, 0);
+}
+
+int sev_tls_pending(struct sev_tls *tls)
+{
+    return SSL_pending(tls->ssl);
+}
+
+void sev_tls_shutdown(struct sev_tls *tls)
+{
+    if (tls->handshaking)
+        return;
+
+    ERR_clear_error();
+    SSL_shutdown(tls->ssl);
+}
+
+const char *sev_tls_error(void)
+{
+    const char *reason = ERR_reason_error_string(ERR_peek_last_error());
+
+    return reason ? reason : "TLS error";
+}
+
+#endif
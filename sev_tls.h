@@ -0,0 +1,86 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SEV_TLS_H
+#define SEV_TLS_H
+
+#ifdef SEV_TLS
+
+#include <stddef.h>
+#include <openssl/ssl.h>
+
+#define TLS_RECORD_SIZE (16 * 1024) // largest plaintext per record
+
+enum sev_tls_status {
+    SEV_TLS_OK,
+    SEV_TLS_WANT_READ,
+    SEV_TLS_WANT_WRITE,
+    SEV_TLS_CLOSED, // close_notify, or end of file during the handshake
+    SEV_TLS_ERROR,
+};
+
+// per connection state
+struct sev_tls {
+    SSL *ssl;
+    int handshaking;
+
+    // records are handled by the kernel in that direction; sends then use
+    // plain syscalls, reads stay on SSL_read() for the non data records
+    int ktls_send;
+    int ktls_recv;
+};
+
+// contexts with kernel TLS enabled and TLS 1.2 as the minimum version;
+// without a ca file the client doesn't verify the server
+SSL_CTX *sev_tls_server_ctx(const char *cert_file, const char *key_file);
+
+SSL_CTX *sev_tls_client_ctx(const char *ca_file);
+
+// clients send hostname as SNI and verify it, unless it is NULL
+struct sev_tls *sev_tls_new(SSL_CTX *ctx, int sd, int client,
+    const char *hostname);
+
+void sev_tls_free(struct sev_tls *tls);
+
+int sev_tls_handshake(struct sev_tls *tls);
+
+// n is set to the bytes moved when SEV_TLS_OK is returned
+int sev_tls_read(struct sev_tls *tls, char *data, size_t len, size_t *n);
+
+int sev_tls_write(struct sev_tls *tls, const char *data, size_t len,
+    size_t *n);
+
+// plaintext already decrypted but not read yet
+int sev_tls_pending(struct sev_tls *tls);
+
+// sends close_notify if the socket takes it right away
+void sev_tls_shutdown(struct sev_tls *tls);
+
+// the reason for the last SEV_TLS_ERROR
+const char *sev_tls_error(void);
+
+#endif
+
+#endif
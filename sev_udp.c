@@ -23,15 +23,44 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE
 #include <string.h>
+#include <stdint.h>
 #include <errno.h>
 #include <sys/socket.h>
 #include <resolv.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <netinet/udp.h>
+#include <linux/filter.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
 #include "sev_udp.h"
 
-#define RECV_BUFFER_SIZE 2048
+struct sev_udp_rx
+{
+    int batch;
+    size_t size;
+
+    struct mmsghdr *hdrs;
+    struct iovec *iovs;
+    struct sev_udp_msg *msgs;
+    char *buffers;
+    char *control;
+
+    // SEV_RECV_BUF: a buffer per message instead of buffers
+    struct sev_buf **bufs;
+};
+
+// room for UDP_GRO, SO_RXQ_OVFL and SO_TIMESTAMPING
+#define RX_CONTROL_SIZE (CMSG_SPACE(sizeof(int)) + \
+    CMSG_SPACE(sizeof(uint32_t)) + CMSG_SPACE(sizeof(struct scm_timestamping)))
+
+// counts on the socket and its loop
+#define COUNT(udp, field, n) do { \
+        (udp)->stats.field += (n); \
+        (udp)->loop->stats.field += (n); \
+    } while (0)
 
 int sev_addr_set(struct sev_addr *addr, const char *address, int port)
 {
@@ -49,55 +78,650 @@ int sev_addr_set(struct sev_addr *addr, const char *address, int port)
     return 0;
 }
 
-static void read_cb(EV_P_ struct ev_io *watcher, int revents)
+static void rx_free(struct sev_udp_rx *rx)
 {
-    if (!(revents & EV_READ)) {
-        // TODO: handle error
+    if (!rx)
         return;
+
+    if (rx->bufs) {
+        int i;
+        for (i = 0; i < rx->batch; i++) {
+            if (rx->bufs[i])
+                sev_buf_release(rx->bufs[i]);
+        }
     }
 
-    static char buffer[RECV_BUFFER_SIZE];
+    free(rx->hdrs);
+    free(rx->iovs);
+    free(rx->msgs);
+    free(rx->buffers);
+    free(rx->control);
+    free(rx->bufs);
+    free(rx);
+}
 
-    struct sev_udp *udp = watcher->data;
-    struct sev_addr addr;
+static struct sev_udp_rx *rx_new(int batch, size_t size, int bufs)
+{
+    struct sev_udp_rx *rx = calloc(1, sizeof(struct sev_udp_rx));
+    if (!rx)
+        return NULL;
 
-    ssize_t n = recvfrom(udp->sd, buffer, RECV_BUFFER_SIZE - 1, 0,
-        &addr.addr, &addr.addr_len);
+    rx->batch = batch;
+    rx->size = size;
+    rx->hdrs = calloc(batch, sizeof(struct mmsghdr));
+    rx->iovs = calloc(batch, sizeof(struct iovec));
+    rx->msgs = calloc(batch, sizeof(struct sev_udp_msg));
+    rx->control = malloc(batch * RX_CONTROL_SIZE);
 
-    if (n == -1) {
-        // TODO: handle error
+    // the buffers themselves are allocated as they are needed
+    if (bufs)
+        rx->bufs = calloc(batch, sizeof(struct sev_buf *));
+    else
+        rx->buffers = malloc(batch * size);
+
+    if (!rx->hdrs || !rx->iovs || !rx->msgs || !rx->control ||
+            (!rx->buffers && !rx->bufs)) {
+        rx_free(rx);
+        return NULL;
+    }
+
+    return rx;
+}
+
+// (re)allocates the receive batch if the settings changed
+static struct sev_udp_rx *udp_rx(struct sev_udp *udp)
+{
+    int batch = udp->batch > 0 ? udp->batch : 1;
+    size_t size = udp->gro ? UDP_GRO_BUFFER_SIZE : RECV_BUFFER_SIZE;
+    int bufs = udp->recv_mode == SEV_RECV_BUF;
+
+    if (udp->rx && udp->rx->batch == batch && udp->rx->size == size &&
+            !udp->rx->bufs == !bufs)
+        return udp->rx;
+
+    rx_free(udp->rx);
+    udp->rx = rx_new(batch, size, bufs);
+
+    return udp->rx;
+}
+
+// points message i at its buffer, returns -1 if out of memory
+static int rx_buffer(struct sev_udp *udp, struct sev_udp_rx *rx, int i)
+{
+    if (!rx->bufs) {
+        rx->iovs[i].iov_base = rx->buffers + i * rx->size;
+        rx->msgs[i].buf = NULL;
+        return 0;
+    }
+
+    if (!rx->bufs[i]) {
+        rx->bufs[i] = sev_loop_buf(udp->loop, rx->size);
+        if (!rx->bufs[i])
+            return -1;
+    }
+
+    rx->iovs[i].iov_base = rx->bufs[i]->data;
+    rx->msgs[i].buf = rx->bufs[i];
+
+    return 0;
+}
+
+// picks up the gro segment size, the drop count and the receive time
+static void rx_control(struct sev_udp *udp, struct msghdr *hdr,
+    struct sev_udp_msg *msg)
+{
+    struct cmsghdr *cmsg;
+
+    msg->segment_size = 0;
+    msg->arrival = 0;
+
+    for (cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO &&
+                udp->gro) {
+            int size;
+            memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+            msg->segment_size = size;
+        }
+        else if (cmsg->cmsg_level == SOL_SOCKET &&
+                cmsg->cmsg_type == SO_RXQ_OVFL) {
+            // a running total, only present once something was dropped
+            uint32_t drops;
+            memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+            COUNT(udp, datagrams_dropped, drops - udp->drops);
+            udp->drops = drops;
+        }
+        else if (cmsg->cmsg_level == SOL_SOCKET &&
+                cmsg->cmsg_type == SCM_TIMESTAMPING) {
+            struct scm_timestamping stamps;
+            memcpy(&stamps, CMSG_DATA(cmsg), sizeof(stamps));
+            msg->arrival = stamps.ts[0].tv_sec + stamps.ts[0].tv_nsec * 1e-9;
+        }
+    }
+}
+
+// the part of a datagram's latency before its callback
+static void timing_arrival(struct sev_udp *udp, struct sev_udp_msg *msg)
+{
+    if (udp->timing && msg->arrival) {
+        sev_timing_arrival(udp->timing, msg->arrival, ev_now(udp->loop->ev),
+            ev_time());
+    }
+}
+
+static void deliver(struct sev_udp *udp, struct sev_udp_msg *msgs, int count)
+{
+    uint64_t start = udp->timing ? sev_clock() : 0;
+    int i;
+
+    if (udp->batch_cb) {
+        for (i = 0; udp->timing && i < count; i++)
+            timing_arrival(udp, &msgs[i]);
+
+        udp->batch_cb(udp, msgs, count);
+
+        // a whole batch at a time
+        if (start && udp->timing)
+            sev_histogram_add(&udp->timing->callback, sev_clock() - start);
+
+        return;
+    }
+
+    if (!udp->read_cb)
         return;
+
+    for (i = 0; i < count; i++) {
+        struct sev_udp_msg *msg = &msgs[i];
+
+        udp->current = msg;
+
+        if (udp->timing) {
+            timing_arrival(udp, msg);
+            start = sev_clock();
+        }
+
+        if (!msg->segment_size) {
+            udp->read_cb(udp, msg->data, msg->len, &msg->addr);
+        }
+        else {
+            // split coalesced datagrams back up
+            size_t offset;
+            for (offset = 0; offset < msg->len; offset += msg->segment_size) {
+                size_t len = MIN(msg->segment_size, msg->len - offset);
+                udp->read_cb(udp, msg->data + offset, len, &msg->addr);
+            }
+        }
+
+        if (udp->timing)
+            sev_histogram_add(&udp->timing->callback, sev_clock() - start);
     }
 
-    if (udp->read_cb)
-        udp->read_cb(udp, buffer, n, &addr);
+    udp->current = NULL;
 }
 
-struct sev_udp *sev_udp_bind(const char *address, int port)
+static void read_cb(EV_P_ struct ev_io *watcher, int revents)
 {
-    int sd = socket(PF_INET, SOCK_DGRAM, 0);
-    if (sd == -1)
-        return NULL;
+    struct sev_udp *udp = watcher->data;
+    int calls;
+
+    // libev gave up on the descriptor and stopped the watcher
+    if (!(revents & EV_READ)) {
+        COUNT(udp, read_errors, 1);
+        return;
+    }
+
+    for (calls = 0; calls < UDP_READ_CALLS; calls++) {
+        struct sev_udp_rx *rx = udp_rx(udp);
+        if (!rx)
+            return;
+
+        int i;
+        for (i = 0; i < rx->batch; i++) {
+            struct msghdr *hdr = &rx->hdrs[i].msg_hdr;
+
+            if (rx_buffer(udp, rx, i) == -1)
+                return;
+
+            // leave room for a terminating null byte
+            rx->iovs[i].iov_len = rx->size - 1;
+
+            hdr->msg_name = &rx->msgs[i].addr.addr;
+            hdr->msg_namelen = sizeof(rx->msgs[i].addr.addr);
+            hdr->msg_iov = &rx->iovs[i];
+            hdr->msg_iovlen = 1;
+            hdr->msg_control = rx->control + i * RX_CONTROL_SIZE;
+            hdr->msg_controllen = RX_CONTROL_SIZE;
+            hdr->msg_flags = 0;
+        }
+
+        int n = recvmmsg(udp->sd, rx->hdrs, rx->batch, MSG_DONTWAIT, NULL);
 
+        COUNT(udp, reads, 1);
+
+        if (n == -1) {
+            if (errno == EAGAIN) {
+                COUNT(udp, read_eagain, 1);
+                return;
+            }
+
+            // ICMP errors like ECONNREFUSED are reported once and cleared,
+            // the datagrams queued behind them are still there
+            COUNT(udp, read_errors, 1);
+            continue;
+        }
+
+        COUNT(udp, datagrams_in, n);
+
+        for (i = 0; i < n; i++) {
+            struct sev_udp_msg *msg = &rx->msgs[i];
+            struct msghdr *hdr = &rx->hdrs[i].msg_hdr;
+
+            msg->data = rx->iovs[i].iov_base;
+            msg->len = rx->hdrs[i].msg_len;
+            msg->addr.addr_len = hdr->msg_namelen;
+            rx_control(udp, hdr, msg);
+
+            if (msg->segment_size >= msg->len)
+                msg->segment_size = 0;
+
+            // coalesced datagrams count one by one
+            if (msg->segment_size) {
+                COUNT(udp, datagrams_in, (msg->len + msg->segment_size - 1) /
+                    msg->segment_size - 1);
+            }
+
+            COUNT(udp, bytes_in, msg->len);
+
+            if (msg->buf)
+                msg->buf->len = msg->len;
+        }
+
+        deliver(udp, rx->msgs, n);
+
+        // buffers the application kept are replaced on the next call
+        for (i = 0; rx->bufs && i < n; i++) {
+            if (sev_buf_shared(rx->bufs[i])) {
+                sev_buf_release(rx->bufs[i]);
+                rx->bufs[i] = NULL;
+            }
+        }
+
+        // the socket is drained
+        if (n < rx->batch)
+            return;
+    }
+}
+
+static struct sev_udp *udp_bind(struct sev_loop *loop, const char *address,
+    int port, int reuseport)
+{
     struct sev_addr addr;
     if (sev_addr_set(&addr, address, port) == -1)
         return NULL;
 
-    if (bind(sd, &addr.addr, addr.addr_len) == -1)
+    int sd = socket(PF_INET, SOCK_DGRAM, 0);
+    if (sd == -1)
+        return NULL;
+
+    int flag = 1;
+
+    if ((reuseport &&
+            setsockopt(sd, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof(flag))) ||
+            bind(sd, &addr.addr, addr.addr_len) == -1) {
+        close(sd);
         return NULL;
+    }
 
     struct sev_udp *udp = calloc(1, sizeof(struct sev_udp));
+    if (!udp) {
+        close(sd);
+        return NULL;
+    }
+
     udp->sd = sd;
+    udp->loop = loop;
+    udp->batch = UDP_BATCH_SIZE;
+
+    // report drops along with the datagrams
+    setsockopt(sd, SOL_SOCKET, SO_RXQ_OVFL, &flag, sizeof(flag));
+
+    socklen_t len = sizeof(udp->rcvbuf);
+    getsockopt(sd, SOL_SOCKET, SO_RCVBUF, &udp->rcvbuf, &len);
 
     ev_io_init(&udp->watcher, read_cb, sd, EV_READ);
     udp->watcher.data = udp;
-    ev_io_start(EV_DEFAULT_ &udp->watcher);
+    ev_io_start(loop->ev, &udp->watcher);
 
     return udp;
 }
 
+struct sev_udp *sev_udp_bind(struct sev_loop *loop, const char *address,
+    int port)
+{
+    if (!loop)
+        loop = sev_loop_default();
+
+    return udp_bind(loop, address, port, 0);
+}
+
+struct sev_buf *sev_udp_recv_buf(struct sev_udp *udp, const char *data)
+{
+    struct sev_udp_msg *msg = udp->current;
+
+    if (!msg || !msg->buf || data < msg->buf->data ||
+            data >= msg->buf->data + udp->rx->size)
+        return NULL;
+
+    return sev_buf_retain(msg->buf);
+}
+
+int sev_udp_timestamps(struct sev_udp *udp, int enable)
+{
+    int flags = enable ?
+        SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE : 0;
+
+    if (setsockopt(udp->sd, SOL_SOCKET, SO_TIMESTAMPING, &flags,
+            sizeof(flags)) == -1)
+        return -1;
+
+    if (enable && !udp->timing) {
+        udp->timing = calloc(1, sizeof(struct sev_timing));
+        if (!udp->timing)
+            return -1;
+    }
+
+    // the breakdown so far stays around
+    return 0;
+}
+
+int sev_udp_set_rcvbuf(struct sev_udp *udp, int size)
+{
+    if (setsockopt(udp->sd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) == -1)
+        return -1;
+
+    socklen_t len = sizeof(udp->rcvbuf);
+    getsockopt(udp->sd, SOL_SOCKET, SO_RCVBUF, &udp->rcvbuf, &len);
+
+    return 0;
+}
+
+// sends each datagram to the socket with the index of the receiving cpu,
+// modulo the group size
+static int steer_bpf(int sd, int count)
+{
+    struct sock_filter code[] = {
+        {BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU},
+        {BPF_ALU | BPF_MOD | BPF_K, 0, 0, count},
+        {BPF_RET | BPF_A, 0, 0, 0},
+    };
+    struct sock_fprog prog = {sizeof(code) / sizeof(code[0]), code};
+
+    return setsockopt(sd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+        sizeof(prog));
+}
+
+struct sev_udp_group *sev_udp_bind_group(const struct sev_udp *proto,
+    const char *address, int port, int count,
+    enum sev_udp_steering steering)
+{
+    int ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (count <= 0)
+        count = ncpu;
+    if (count <= 0)
+        count = 1;
+
+    struct sev_udp_group *group = calloc(1, sizeof(struct sev_udp_group));
+    if (!group)
+        return NULL;
+
+    group->sockets = calloc(count, sizeof(struct sev_udp *));
+    if (!group->sockets) {
+        free(group);
+        return NULL;
+    }
+
+    for (; group->count < count; group->count++) {
+        int i = group->count;
+
+        struct sev_loop *loop = sev_loop_new();
+        if (!loop) {
+            sev_udp_group_free(group);
+            return NULL;
+        }
+
+        struct sev_udp *udp = udp_bind(loop, address, port, 1);
+        if (!udp) {
+            sev_loop_free(loop);
+            sev_udp_group_free(group);
+            return NULL;
+        }
+
+        group->sockets[i] = udp;
+
+        udp->data = proto->data;
+        udp->read_cb = proto->read_cb;
+        udp->batch_cb = proto->batch_cb;
+        udp->recv_mode = proto->recv_mode;
+        if (proto->batch)
+            udp->batch = proto->batch;
+
+        if (proto->gro)
+            sev_udp_set_gro(udp, 1);
+
+        if (proto->timing)
+            sev_udp_timestamps(udp, 1);
+
+        // sized before any traffic shows up
+        if (proto->rcvbuf_request) {
+            udp->rcvbuf_request = proto->rcvbuf_request;
+            sev_udp_set_rcvbuf(udp, proto->rcvbuf_request);
+        }
+
+        // matches the cpu sev_udp_group_run() pins the loop to
+        if (steering == SEV_STEER_CPU && ncpu > 0) {
+            int cpu = i % ncpu;
+            setsockopt(udp->sd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+        }
+    }
+
+    // the program belongs to the whole group, any member can attach it
+    if (steering == SEV_STEER_BPF &&
+            steer_bpf(group->sockets[0]->sd, group->count) == -1) {
+        sev_udp_group_free(group);
+        return NULL;
+    }
+
+    return group;
+}
+
+int sev_udp_group_run(struct sev_udp_group *group)
+{
+    int i, rv = 0;
+
+    for (i = 0; i < group->count; i++) {
+        if (sev_loop_spawn(group->sockets[i]->loop, i) == -1) {
+            rv = -1;
+            break;
+        }
+    }
+
+    // stop the loops that did start if one of them failed
+    int started = i;
+    if (rv == -1) {
+        for (i = 0; i < started; i++)
+            sev_loop_stop(group->sockets[i]->loop);
+    }
+
+    for (i = 0; i < started; i++)
+        sev_loop_join(group->sockets[i]->loop);
+
+    return rv;
+}
+
+void sev_udp_group_free(struct sev_udp_group *group)
+{
+    int i;
+
+    for (i = 0; i < group->count; i++) {
+        struct sev_udp *udp = group->sockets[i];
+        struct sev_loop *loop = udp->loop;
+
+        ev_io_stop(loop->ev, &udp->watcher);
+        close(udp->sd);
+        rx_free(udp->rx);
+        free(udp->timing);
+        free(udp);
+        sev_loop_free(loop);
+    }
+
+    free(group->sockets);
+    free(group);
+}
+
+// counts the outcome of a send of count datagrams
+static void count_send(struct sev_udp *udp, ssize_t n, size_t count)
+{
+    COUNT(udp, writes, 1);
+
+    if (n == -1) {
+        if (errno == EAGAIN)
+            COUNT(udp, write_eagain, 1);
+        return;
+    }
+
+    COUNT(udp, bytes_out, n);
+    COUNT(udp, datagrams_out, count);
+}
+
 int sev_udp_sendto(struct sev_udp *udp, const char *data, size_t len,
     struct sev_addr *addr)
 {
-    return sendto(udp->sd, data, len, 0, &addr->addr, addr->addr_len);
+    ssize_t n = sendto(udp->sd, data, len, 0, &addr->addr, addr->addr_len);
+
+    count_send(udp, n, 1);
+
+    return n;
+}
+
+int sev_udp_sendto_batch(struct sev_udp *udp, struct sev_udp_msg *msgs,
+    int count)
+{
+    struct mmsghdr hdrs[UDP_BATCH_SIZE];
+    struct iovec iovs[UDP_BATCH_SIZE];
+    int sent = 0;
+
+    while (sent < count) {
+        int batch = MIN(count - sent, UDP_BATCH_SIZE);
+        int i;
+
+        memset(hdrs, 0, batch * sizeof(struct mmsghdr));
+
+        for (i = 0; i < batch; i++) {
+            struct sev_udp_msg *msg = &msgs[sent + i];
+
+            iovs[i].iov_base = msg->data;
+            iovs[i].iov_len = msg->len;
+            hdrs[i].msg_hdr.msg_name = &msg->addr.addr;
+            hdrs[i].msg_hdr.msg_namelen = msg->addr.addr_len;
+            hdrs[i].msg_hdr.msg_iov = &iovs[i];
+            hdrs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        int n = sendmmsg(udp->sd, hdrs, batch, 0);
+
+        COUNT(udp, writes, 1);
+
+        if (n == -1) {
+            if (errno == EAGAIN)
+                COUNT(udp, write_eagain, 1);
+
+            return sent ? sent : -1;
+        }
+
+        for (i = 0; i < n; i++)
+            COUNT(udp, bytes_out, hdrs[i].msg_len);
+
+        COUNT(udp, datagrams_out, n);
+        sent += n;
+
+        // the socket buffer is full
+        if (n < batch)
+            break;
+    }
+
+    return sent;
+}
+
+int sev_udp_sendto_gso(struct sev_udp *udp, const char *data, size_t len,
+    size_t segment_size, struct sev_addr *addr)
+{
+    if (segment_size == 0 || len > segment_size * UDP_GSO_MAX_SEGMENTS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    char control[CMSG_SPACE(sizeof(uint16_t))] = {};
+    struct iovec iov = { (void *)data, len };
+
+    struct msghdr msg = {};
+    msg.msg_name = &addr->addr;
+    msg.msg_namelen = addr->addr_len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+
+    uint16_t size = segment_size;
+    memcpy(CMSG_DATA(cmsg), &size, sizeof(size));
+
+    ssize_t n = sendmsg(udp->sd, &msg, 0);
+
+    count_send(udp, n, (len + segment_size - 1) / segment_size);
+
+    return n;
+}
+
+int sev_udp_set_gro(struct sev_udp *udp, int enable)
+{
+    enable = !!enable;
+
+    if (setsockopt(udp->sd, SOL_UDP, UDP_GRO, &enable, sizeof(enable)) == -1)
+        return -1;
+
+    udp->gro = enable;
+
+    return 0;
+}
+
+static void stats_cb(struct sev_udp *udp, char *data, size_t len,
+    struct sev_addr *addr)
+{
+    struct sev_stats stats;
+    char reply[STATS_REPLY_SIZE];
+
+    sev_loop_stats(udp->loop, &stats);
+
+    int n = sev_stats_format(&stats, reply, sizeof(reply));
+    if (n < 0)
+        return;
+
+    sev_udp_sendto(udp, reply, MIN((size_t)n, sizeof(reply) - 1), addr);
+}
+
+struct sev_udp *sev_stats_listen(struct sev_loop *loop, const char *address,
+    int port)
+{
+    struct sev_udp *udp = sev_udp_bind(loop, address, port);
+    if (!udp)
+        return NULL;
+
+    udp->read_cb = stats_cb;
+    udp->batch = 1;
+
+    return udp;
 }
@@ -29,6 +29,7 @@
 #include <stdlib.h>
 #include <arpa/inet.h>
 #include <ev.h>
+#include "sev.h"
 
 struct sev_addr
 {
@@ -36,22 +37,143 @@ struct sev_addr
     socklen_t addr_len;
 };
 
+#define UDP_BATCH_SIZE 32 // datagrams per recvmmsg
+#define UDP_READ_CALLS 8 // recvmmsg calls per wakeup
+#define UDP_GRO_BUFFER_SIZE 65536
+#define UDP_GSO_MAX_SEGMENTS 64
+#define STATS_REPLY_SIZE 4096
+
+struct sev_udp_msg
+{
+    char *data;
+    size_t len;
+    struct sev_addr addr;
+
+    // with GRO, data holds several datagrams of segment_size bytes from the
+    // same sender (the last one may be shorter), 0 otherwise
+    size_t segment_size;
+
+    // SEV_RECV_BUF: the buffer data lives in, retain it to keep the data
+    // past the callback; NULL otherwise
+    struct sev_buf *buf;
+
+    // kernel receive time in ev_time() terms, 0 unless timestamping
+    ev_tstamp arrival;
+};
+
+// how a group spreads datagrams over its sockets
+enum sev_udp_steering {
+    SEV_STEER_HASH, // the kernel's flow hash
+    SEV_STEER_CPU,  // SO_INCOMING_CPU hints, best effort
+    SEV_STEER_BPF,  // a reuseport program picks the socket of the cpu the
+                    // datagram arrived on
+};
+
 struct sev_udp
 {
     int sd;
     struct ev_io watcher;
+    struct sev_loop *loop;
 
     void *data;
 
+    // called once per datagram
     void (*read_cb)(struct sev_udp *, char *data, size_t len,
         struct sev_addr *addr);
+
+    // called once per recvmmsg batch instead of read_cb, if set
+    void (*batch_cb)(struct sev_udp *, struct sev_udp_msg *msgs, int count);
+
+    // datagrams per recvmmsg, can be changed at any time
+    int batch;
+
+    // set by sev_udp_set_gro()
+    int gro;
+
+    // SEV_RECV_BUF gives every datagram a refcounted buffer of its own, see
+    // sev_udp_msg.buf; any other mode reuses the batch's buffers
+    enum sev_recv_mode recv_mode;
+
+    // receive batch, sized for the batch/gro/recv_mode settings it was
+    // allocated with
+    struct sev_udp_rx *rx;
+
+    // the datagram being delivered to read_cb
+    struct sev_udp_msg *current;
+
+    // latency breakdown, see sev_udp_timestamps()
+    struct sev_timing *timing;
+
+    // receive buffer size as reported by the kernel, see
+    // sev_udp_set_rcvbuf()
+    int rcvbuf;
+
+    // in a group's proto, the size each socket passes to
+    // sev_udp_set_rcvbuf(), 0 for the default; rcvbuf isn't used since a
+    // bound proto reports it doubled
+    int rcvbuf_request;
+
+    // the socket's running SO_RXQ_OVFL count, drops go to stats
+    uint32_t drops;
+
+    // also added to the loop's totals
+    struct sev_counters stats;
 };
 
 int sev_addr_set(struct sev_addr *addr, const char *address, int port);
 
-struct sev_udp *sev_udp_bind(const char *address, int port);
+// a NULL loop means the default loop
+struct sev_udp *sev_udp_bind(struct sev_loop *loop, const char *address,
+    int port);
 
 int sev_udp_sendto(struct sev_udp *udp, const char *data, size_t len,
     struct sev_addr *addr);
 
+// sends count datagrams with a single sendmmsg, returns how many were sent
+int sev_udp_sendto_batch(struct sev_udp *udp, struct sev_udp_msg *msgs,
+    int count);
+
+// lets the kernel (or the nic) split data into segment_size datagrams, all
+// sent to addr
+int sev_udp_sendto_gso(struct sev_udp *udp, const char *data, size_t len,
+    size_t segment_size, struct sev_addr *addr);
+
+// asks the kernel to coalesce datagrams from the same flow, see
+// sev_udp_msg.segment_size
+int sev_udp_set_gro(struct sev_udp *udp, int enable);
+
+// from read_cb in SEV_RECV_BUF mode, returns a reference to the buffer data
+// points into, NULL if it doesn't live in one
+struct sev_buf *sev_udp_recv_buf(struct sev_udp *udp, const char *data);
+
+// SO_TIMESTAMPING software receive times in sev_udp_msg.arrival, feeding
+// udp->timing (no send samples, those need a TCP ack)
+int sev_udp_timestamps(struct sev_udp *udp, int enable);
+
+// sizes the socket's receive buffer, the kernel doubles size and caps it at
+// net.core.rmem_max
+int sev_udp_set_rcvbuf(struct sev_udp *udp, int size);
+
+// count sockets bound to the same address with SO_REUSEPORT (one per cpu if
+// count is 0), each on its own loop; callbacks, batch, gro, recv_mode,
+// rcvbuf_request, timestamping and user data are copied from proto
+struct sev_udp_group {
+    int count;
+    struct sev_udp **sockets;
+};
+
+struct sev_udp_group *sev_udp_bind_group(const struct sev_udp *proto,
+    const char *address, int port, int count,
+    enum sev_udp_steering steering);
+
+// runs every socket's loop on its own thread, socket i pinned to cpu i;
+// returns once all the loops have stopped
+int sev_udp_group_run(struct sev_udp_group *group);
+
+void sev_udp_group_free(struct sev_udp_group *group);
+
+// answers every datagram with the loop's stats, see sev_stats_format()
+struct sev_udp *sev_stats_listen(struct sev_loop *loop, const char *address,
+    int port);
+
 #endif
@@ -0,0 +1,245 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef SEV_URING
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "sev_uring.h"
+
+static int uring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+    unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+        NULL, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg,
+    unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void *ring_map(int fd, size_t size, off_t offset)
+{
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, offset);
+
+    return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+int sev_uring_init(struct sev_uring *ring, unsigned entries)
+{
+    struct io_uring_params params;
+    unsigned i;
+
+    memset(ring, 0, sizeof(struct sev_uring));
+    memset(&params, 0, sizeof(params));
+
+    // completions are only reaped from the loop, leave room for bursts
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = entries * 4;
+
+    ring->fd = uring_setup(entries, &params);
+    if (ring->fd == -1)
+        return -1;
+
+    ring->sq_ring_size = params.sq_off.array +
+        params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes +
+        params.cq_entries * sizeof(struct io_uring_cqe);
+
+    // both rings live in one mapping on anything recent
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = 0;
+    }
+
+    ring->sq_ring = ring_map(ring->fd, ring->sq_ring_size, IORING_OFF_SQ_RING);
+    if (!ring->sq_ring)
+        goto fail;
+
+    if (ring->cq_ring_size) {
+        ring->cq_ring = ring_map(ring->fd, ring->cq_ring_size,
+            IORING_OFF_CQ_RING);
+        if (!ring->cq_ring)
+            goto fail;
+    }
+    else {
+        ring->cq_ring = ring->sq_ring;
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = ring_map(ring->fd, ring->sqes_size, IORING_OFF_SQES);
+    if (!ring->sqes)
+        goto fail;
+
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sqe_tail = *ring->sq_tail;
+    ring->submitted = ring->sqe_tail;
+
+    // sqes are always used in order
+    unsigned *array = (unsigned *)(sq + params.sq_off.array);
+    for (i = 0; i < params.sq_entries; i++)
+        array[i] = i;
+
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    return 0;
+
+fail:
+    sev_uring_free(ring);
+    return -1;
+}
+
+void sev_uring_free(struct sev_uring *ring)
+{
+    if (ring->buf_ring)
+        munmap(ring->buf_ring, ring->buf_ring_size);
+
+    free(ring->buffers);
+
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqes_size);
+
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+
+    if (ring->sq_ring)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+
+    if (ring->fd > 0)
+        close(ring->fd);
+
+    memset(ring, 0, sizeof(struct sev_uring));
+    ring->fd = -1;
+}
+
+int sev_uring_buffers(struct sev_uring *ring, unsigned count, size_t size)
+{
+    struct io_uring_buf_reg reg;
+    unsigned i;
+
+    ring->buf_ring_size = count * sizeof(struct io_uring_buf);
+    ring->buf_ring = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (ring->buf_ring == MAP_FAILED) {
+        ring->buf_ring = NULL;
+        return -1;
+    }
+
+    ring->buffers = malloc((size_t)count * size);
+    if (!ring->buffers)
+        return -1;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)ring->buf_ring;
+    reg.ring_entries = count;
+    reg.bgid = URING_BUFFER_GROUP;
+
+    if (uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+        return -1;
+
+    ring->buffer_count = count;
+    ring->buffer_size = size;
+
+    for (i = 0; i < count; i++)
+        sev_uring_buffer_put(ring, i);
+
+    return 0;
+}
+
+void sev_uring_buffer_put(struct sev_uring *ring, unsigned id)
+{
+    struct io_uring_buf_ring *buf_ring = ring->buf_ring;
+    unsigned short tail = buf_ring->tail;
+    struct io_uring_buf *buf = &buf_ring->bufs[tail & (ring->buffer_count - 1)];
+
+    // keep a spare byte past what the kernel may fill
+    buf->addr = (unsigned long)sev_uring_buffer(ring, id);
+    buf->len = ring->buffer_size - 1;
+    buf->bid = id;
+
+    __atomic_store_n(&buf_ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+struct io_uring_sqe *sev_uring_sqe(struct sev_uring *ring)
+{
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    if (ring->sqe_tail - head >= ring->sq_entries) {
+        sev_uring_submit(ring);
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+        if (ring->sqe_tail - head >= ring->sq_entries)
+            return NULL;
+    }
+
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+    ring->sqe_tail++;
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+    return sqe;
+}
+
+int sev_uring_submit(struct sev_uring *ring)
+{
+    unsigned pending = ring->sqe_tail - ring->submitted;
+
+    if (!pending)
+        return 0;
+
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+    int n = uring_enter(ring->fd, pending, 0, 0);
+    if (n == -1)
+        return errno == EAGAIN || errno == EBUSY ? 0 : -1;
+
+    ring->submitted += n;
+
+    return n;
+}
+
+#endif
@@ -0,0 +1,114 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SEV_URING_H
+#define SEV_URING_H
+
+#ifdef SEV_URING
+
+#include <stdlib.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES 256
+#define URING_BUFFERS 256 // provided receive buffers, a power of two
+#define URING_BUFFER_SIZE (16 * 1024)
+#define URING_BUFFER_GROUP 0
+
+// a bare io_uring instance, driven through the raw syscalls
+struct sev_uring {
+    int fd;
+
+    // submission queue
+    void *sq_ring;
+    size_t sq_ring_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    // sqes handed out, and the part of them the kernel has seen
+    unsigned sqe_tail;
+    unsigned submitted;
+
+    // completion queue
+    void *cq_ring;
+    size_t cq_ring_size;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // provided buffers for receives with IOSQE_BUFFER_SELECT
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    char *buffers;
+    unsigned buffer_count;
+    size_t buffer_size;
+};
+
+int sev_uring_init(struct sev_uring *ring, unsigned entries);
+
+void sev_uring_free(struct sev_uring *ring);
+
+// registers count buffers of size bytes as URING_BUFFER_GROUP
+int sev_uring_buffers(struct sev_uring *ring, unsigned count, size_t size);
+
+// a cleared sqe, submitting the pending ones first if the queue is full;
+// NULL if there is still no room
+struct io_uring_sqe *sev_uring_sqe(struct sev_uring *ring);
+
+// hands the pending sqes to the kernel, returns how many it took
+int sev_uring_submit(struct sev_uring *ring);
+
+// the next completion, NULL if there is none
+static inline struct io_uring_cqe *sev_uring_cqe(struct sev_uring *ring)
+{
+    unsigned head = *ring->cq_head;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+// done with the completion returned by sev_uring_cqe()
+static inline void sev_uring_seen(struct sev_uring *ring)
+{
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+static inline char *sev_uring_buffer(struct sev_uring *ring, unsigned id)
+{
+    return ring->buffers + (size_t)id * ring->buffer_size;
+}
+
+// gives a selected buffer back to the kernel
+void sev_uring_buffer_put(struct sev_uring *ring, unsigned id);
+
+#endif
+
+#endif
@@ -0,0 +1,175 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "sev_wheel.h"
+
+#define SLOT_MASK (WHEEL_SLOTS - 1)
+
+static void list_init(struct sev_timer *head)
+{
+    head->next = head;
+    head->prev = head;
+}
+
+static void list_add(struct sev_timer *head, struct sev_timer *timer)
+{
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void list_del(struct sev_timer *timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = 0;
+    timer->prev = 0;
+}
+
+void sev_wheel_init(struct sev_wheel *wheel, uint64_t now)
+{
+    int level, slot;
+
+    wheel->now = now;
+    wheel->count = 0;
+
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+        for (slot = 0; slot < WHEEL_SLOTS; slot++)
+            list_init(&wheel->slots[level][slot]);
+    }
+}
+
+static void place(struct sev_wheel *wheel, struct sev_timer *timer)
+{
+    uint64_t expires = timer->expires;
+
+    // already due, fire on the next tick
+    if (expires <= wheel->now)
+        expires = wheel->now + 1;
+
+    uint64_t delta = expires - wheel->now;
+    int level = 0;
+
+    while (level < WHEEL_LEVELS - 1 &&
+            delta >= (uint64_t)1 << (WHEEL_BITS * (level + 1)))
+        level++;
+
+    // clamp far away deadlines to the last slot of the top level, they
+    // are placed again once it comes around
+    if (delta >= (uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+        expires = wheel->now + ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+
+    int slot = (expires >> (WHEEL_BITS * level)) & SLOT_MASK;
+    list_add(&wheel->slots[level][slot], timer);
+}
+
+void sev_wheel_add(struct sev_wheel *wheel, struct sev_timer *timer,
+    uint64_t expires)
+{
+    if (sev_timer_pending(timer))
+        sev_wheel_remove(wheel, timer);
+
+    timer->expires = expires;
+    place(wheel, timer);
+    wheel->count++;
+}
+
+void sev_wheel_remove(struct sev_wheel *wheel, struct sev_timer *timer)
+{
+    if (!sev_timer_pending(timer))
+        return;
+
+    list_del(timer);
+    wheel->count--;
+}
+
+// moves the timers of a higher level slot down to where they belong now
+static void cascade(struct sev_wheel *wheel, int level)
+{
+    int slot = (wheel->now >> (WHEEL_BITS * level)) & SLOT_MASK;
+    struct sev_timer *head = &wheel->slots[level][slot];
+
+    struct sev_timer list;
+    list_init(&list);
+
+    if (head->next == head)
+        return;
+
+    // detach the whole slot first, place() may put timers back into it
+    list.next = head->next;
+    list.prev = head->prev;
+    list.next->prev = &list;
+    list.prev->next = &list;
+    list_init(head);
+
+    while (list.next != &list) {
+        struct sev_timer *timer = list.next;
+        list_del(timer);
+        place(wheel, timer);
+    }
+}
+
+void sev_wheel_advance(struct sev_wheel *wheel, uint64_t now,
+    sev_wheel_cb *cb, void *data)
+{
+    while (wheel->now < now) {
+        wheel->now++;
+
+        // every 64^n ticks the next slot of level n comes down
+        int level;
+        for (level = 1; level < WHEEL_LEVELS; level++) {
+            if (wheel->now & (((uint64_t)1 << (WHEEL_BITS * level)) - 1))
+                break;
+
+            cascade(wheel, level);
+        }
+
+        struct sev_timer *head = &wheel->slots[0][wheel->now & SLOT_MASK];
+
+        struct sev_timer list;
+        list_init(&list);
+
+        if (head->next != head) {
+            list.next = head->next;
+            list.prev = head->prev;
+            list.next->prev = &list;
+            list.prev->next = &list;
+            list_init(head);
+        }
+
+        while (list.next != &list) {
+            struct sev_timer *timer = list.next;
+            list_del(timer);
+            wheel->count--;
+
+            cb(timer, data);
+        }
+
+        // nothing left to wait for, catch up in one go
+        if (wheel->count == 0)
+            wheel->now = now;
+    }
+}
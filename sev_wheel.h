@@ -0,0 +1,70 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SEV_WHEEL_H
+#define SEV_WHEEL_H
+
+#include <stdint.h>
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4 // 64^4 ticks
+
+// a deadline, embedded in whatever it belongs to
+struct sev_timer {
+    struct sev_timer *next;
+    struct sev_timer *prev;
+    uint64_t expires;
+};
+
+// hierarchical timing wheel: level n holds the timers due within 64^(n+1)
+// ticks, adding and removing is O(1)
+struct sev_wheel {
+    uint64_t now;
+    unsigned count;
+    struct sev_timer slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+typedef void (sev_wheel_cb)(struct sev_timer *timer, void *data);
+
+void sev_wheel_init(struct sev_wheel *wheel, uint64_t now);
+
+// expires is in ticks, timers already due fire on the next advance
+void sev_wheel_add(struct sev_wheel *wheel, struct sev_timer *timer,
+    uint64_t expires);
+
+void sev_wheel_remove(struct sev_wheel *wheel, struct sev_timer *timer);
+
+static inline int sev_timer_pending(struct sev_timer *timer)
+{
+    return timer->next != 0;
+}
+
+// moves the wheel forward to now, calling cb for each expired timer; cb may
+// add and remove timers
+void sev_wheel_advance(struct sev_wheel *wheel, uint64_t now,
+    sev_wheel_cb *cb, void *data);
+
+#endif
@@ -0,0 +1,286 @@
+/*-
+ * Copyright (c) 2013, Lessandro Mariano
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// TLS over loopback with a throwaway self-signed certificate: echo and
+// sendfile both ways through the handshake, a clean close, a truncated
+// stream and a hostname mismatch, one after the other
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include "../sev.h"
+#include "../sev_tls.h"
+
+#define ADDRESS "127.0.0.1"
+#define PORT 6701
+#define MESSAGE_SIZE (1024 * 1024)
+#define FILE_SIZE (300 * 1000)
+#define TIMEOUT 10.0
+
+enum stage {
+    STAGE_ECHO,     // data and a file echoed back, then sev_close()
+    STAGE_TRUNCATE, // the client's socket goes away without close_notify
+    STAGE_MISMATCH, // the certificate isn't for the requested hostname
+    STAGE_DONE,
+};
+
+static enum stage stage;
+static SSL_CTX *client_ctx;
+static char cert_file[] = "/tmp/sev-test-cert-XXXXXX";
+static char key_file[] = "/tmp/sev-test-key-XXXXXX";
+static char data_file[] = "/tmp/sev-test-data-XXXXXX";
+static char *expected;
+static size_t received;
+
+static void fail(const char *what)
+{
+    fprintf(stderr, "tls: %s\n", what);
+    unlink(cert_file);
+    unlink(key_file);
+    unlink(data_file);
+    exit(1);
+}
+
+static void write_pem(char *path, X509 *cert, EVP_PKEY *key)
+{
+    int fd = mkstemp(path);
+    FILE *f = fd == -1 ? NULL : fdopen(fd, "w");
+    if (!f)
+        fail("can't create a temporary file");
+
+    int ok = cert ? PEM_write_X509(f, cert) :
+        PEM_write_PrivateKey(f, key, NULL, NULL, 0, NULL, NULL);
+
+    if (fclose(f) != 0 || !ok)
+        fail("can't write the certificate");
+}
+
+// for localhost, valid for a day
+static void make_certificate(void)
+{
+    EVP_PKEY *key = EVP_EC_gen("P-256");
+    X509 *cert = X509_new();
+    if (!key || !cert)
+        fail("can't generate a key");
+
+    X509_set_version(cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 24 * 3600);
+    X509_set_pubkey(cert, key);
+
+    X509_NAME *name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+        (const unsigned char *)"localhost", -1, -1, 0);
+    X509_set_issuer_name(cert, name);
+
+    if (!X509_sign(cert, key, EVP_sha256()))
+        fail("can't sign the certificate");
+
+    write_pem(cert_file, cert, NULL);
+    write_pem(key_file, NULL, key);
+
+    X509_free(cert);
+    EVP_PKEY_free(key);
+}
+
+static void make_data(void)
+{
+    int i;
+
+    expected = malloc(MESSAGE_SIZE + FILE_SIZE);
+    if (!expected)
+        fail("out of memory");
+
+    for (i = 0; i < MESSAGE_SIZE + FILE_SIZE; i++)
+        expected[i] = i * 7 + i / 251;
+
+    int fd = mkstemp(data_file);
+    if (fd == -1 ||
+            write(fd, expected + MESSAGE_SIZE, FILE_SIZE) != FILE_SIZE)
+        fail("can't write the data file");
+
+    close(fd);
+}
+
+static void start(void);
+
+static void echo_cb(struct sev_stream *stream, char *data, size_t len)
+{
+    sev_send(stream, data, len);
+}
+
+static void server_close_cb(struct sev_stream *stream, const char *reason)
+{
+    switch (stage) {
+    case STAGE_ECHO:
+        if (stream->close_code != SEV_CLOSE_PEER)
+            fail("close_notify didn't close cleanly");
+        break;
+
+    case STAGE_TRUNCATE:
+        if (stream->close_code != SEV_CLOSE_ERROR)
+            fail("a truncated stream closed cleanly");
+        break;
+
+    default:
+        return;
+    }
+
+    stage++;
+    start();
+}
+
+static void sendfile_cb(struct sev_stream *stream, int fd, int status)
+{
+    close(fd);
+
+    if (status != 0)
+        fail("sendfile failed");
+}
+
+static void read_cb(struct sev_stream *stream, char *data, size_t len)
+{
+    if (received + len > MESSAGE_SIZE + FILE_SIZE ||
+            memcmp(data, expected + received, len) != 0)
+        fail("echoed data doesn't match");
+
+    received += len;
+
+    if (received == MESSAGE_SIZE + FILE_SIZE)
+        sev_close(stream, "done");
+}
+
+static void connect_cb(struct sev_stream *stream, const char *error)
+{
+    switch (stage) {
+    case STAGE_ECHO:
+        if (error)
+            fail(error);
+        if (SSL_version(stream->tls->ssl) != TLS1_3_VERSION)
+            fail("not TLS 1.3");
+        break;
+
+    case STAGE_TRUNCATE:
+        if (error)
+            fail(error);
+
+        // no close_notify
+        shutdown(stream->sd, SHUT_WR);
+        break;
+
+    case STAGE_MISMATCH:
+        if (!error)
+            fail("hostname mismatch went unnoticed");
+
+        stage++;
+        sev_loop_stop(NULL);
+        break;
+
+    default:
+        break;
+    }
+}
+
+static void start(void)
+{
+    if (stage == STAGE_DONE)
+        return;
+
+    struct sev_stream *stream = sev_connect(NULL, ADDRESS, PORT);
+    if (!stream)
+        fail("sev_connect failed");
+
+    const char *hostname = stage == STAGE_MISMATCH ?
+        "wrong.example" : "localhost";
+
+    if (sev_tls_connect(stream, client_ctx, hostname) == -1)
+        fail("sev_tls_connect failed");
+
+    stream->connect_cb = connect_cb;
+    stream->read_cb = read_cb;
+    stream->sendfile_cb = sendfile_cb;
+
+    if (stage != STAGE_ECHO)
+        return;
+
+    // queued during the handshake
+    stream->send_limit = MESSAGE_SIZE + FILE_SIZE;
+    sev_send(stream, expected, MESSAGE_SIZE);
+
+    int fd = open(data_file, O_RDONLY);
+    if (fd == -1 || sev_sendfile(stream, fd, 0, FILE_SIZE) == -1)
+        fail("sev_sendfile failed");
+}
+
+static void timeout_cb(EV_P_ struct ev_timer *watcher, int revents)
+{
+    fail("timed out");
+}
+
+int main(void)
+{
+    struct sev_server server;
+    struct ev_timer timeout;
+
+    make_certificate();
+    make_data();
+
+    if (sev_listen(NULL, &server, ADDRESS, PORT) == -1)
+        fail("sev_listen failed");
+
+    server.read_cb = echo_cb;
+    server.close_cb = server_close_cb;
+    server.send_limit = MESSAGE_SIZE + FILE_SIZE;
+    server.tls = sev_tls_server_ctx(cert_file, key_file);
+    client_ctx = sev_tls_client_ctx(cert_file);
+    if (!server.tls || !client_ctx)
+        fail("can't create the contexts");
+
+    ev_timer_init(&timeout, timeout_cb, TIMEOUT, 0);
+    ev_timer_start(sev_loop_default()->ev, &timeout);
+
+    start();
+    sev_loop();
+
+    unlink(cert_file);
+    unlink(key_file);
+    unlink(data_file);
+    SSL_CTX_free(server.tls);
+    SSL_CTX_free(client_ctx);
+    free(expected);
+
+    if (stage != STAGE_DONE)
+        fail("stopped early");
+
+    printf("tls ok\n");
+
+    return 0;
+}